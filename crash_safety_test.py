@@ -1,4 +1,5 @@
 import os
+import sys
 from subprocess import call
 from multiprocessing import Process
 import time
@@ -10,6 +11,12 @@ test = "lab4test_c"
 output_file = "output.txt"
 ansi_escape = re.compile(r'\x1B(?:[@-Z\\-_]|\[[0-?]*[ -/]*[@-~])')
 
+# --recovery: crash with these many blocks written to the log.
+# Build with a larger NLOG (see user/Makefrag) to try bigger fills.
+recovery_fills = [0, 1, 4, 8, 16, 20]
+recovery_runs = 3
+mount_re = re.compile(r'mount: replayed (\d+) log blocks in (\d+) ticks, (\d+) cycles')
+
 def main():
     garbage = open("garbage.txt", 'w')
     call(["make","clean"], stdout = garbage, stderr = garbage)
@@ -55,5 +62,44 @@ def main():
 
     r.close()
 
+# Recovery-time benchmark.  For each fill, has logfill commit that
+# many blocks and crash before the log is checkpointed, and reads
+# back the time the next boot took to mount and recover.
+def recovery():
+    garbage = open("garbage.txt", 'w')
+    call(["make","clean"], stdout = garbage, stderr = garbage)
+    call(["make"], stdout = garbage, stderr = garbage)
+    print("make finished.")
+
+    w = open(output_file, 'w')
+    process = Popen([r'make', 'qemu'], stdin=PIPE, stdout=w)
+    time.sleep(5)
+    fills = [n for n in recovery_fills for _ in range(recovery_runs)]
+    for n in fills:
+        process.stdin.write(("logfill " + str(n) + "\n").encode())
+        process.stdin.flush()
+        time.sleep(5)
+        print("finished logfill " + str(n))
+    process.terminate()
+    call(["pkill","qemu"], stdout = garbage, stderr = garbage)
+    garbage.close()
+    w.close()
+    os.remove("garbage.txt")
+
+    r = open(output_file, 'r')
+    mounts = mount_re.findall(ansi_escape.sub('', r.read()))
+    r.close()
+
+    # The first mount is the boot before any crash.
+    mounts = mounts[1:]
+    if len(mounts) < len(fills):
+        print("test is not finished yet!")
+    print("written  replayed  ticks  cycles")
+    for n, (blocks, ticks, cycles) in zip(fills, mounts):
+        print("%7d  %8s  %5s  %s" % (n, blocks, ticks, cycles))
+
 if __name__ == "__main__":
-    main()
+    if len(sys.argv) > 1 and sys.argv[1] == "--recovery":
+        recovery()
+    else:
+        main()
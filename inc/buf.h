@@ -5,10 +5,16 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // LRU list of unreferenced buffers
   struct buf *next;
-  struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  struct buf *hnext; // hash chain
+  struct buf *qnext; // disk queue, by blockno
+  struct buf *qprev;
+  struct buf *fnext; // disk queue, by arrival
+  struct buf *fprev;
+  uint qtime;        // ticks when queued for the disk
+  uchar *data;       // BSIZE bytes, carved out of a kalloc'd page
 };
 #define B_VALID 0x2 // buffer has been read from disk
 #define B_DIRTY 0x4 // buffer needs to be written to disk
+#define B_LOGGED 0x8 // buffer holds changes not checkpointed from the log yet
@@ -5,7 +5,11 @@ struct buf;
 struct context;
 struct extent;
 struct inode;
+struct iosched;
+struct ioqueue;
+struct pcifunc;
 struct proc;
+struct readahead;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
@@ -22,6 +26,17 @@ extern int pages_in_swap;
 extern int free_pages;
 extern int num_page_faults;
 extern int num_disk_reads;
+extern int num_bcache_hits;
+extern int num_bcache_misses;
+extern int num_bcache_evictions;
+extern int num_dirty_writebacks;
+extern int num_disk_cmds;
+extern int num_disk_sectors;
+extern int io_wait_ticks;
+extern int num_icache_hits;
+extern int num_icache_misses;
+extern int num_dcache_hits;
+extern int num_dcache_misses;
 
 extern int crashn_enable;
 extern int crashn;
@@ -45,9 +60,17 @@ extern int crashn;
 
 // bio.c
 void binit(void);
+void bprefetchinit(void);
 struct buf *bread(uint, uint);
+struct buf *bread_async(uint, uint);
+struct buf *bgetblk(uint, uint);
+void bprefetch(uint, uint, uint);
 void brelse(struct buf *);
 void bwrite(struct buf *);
+void bflush(struct buf *);
+void bflush_async(struct buf *);
+void bwait(struct buf *);
+int bcachesize(void);
 void print_data_at_block(uint);
 
 // console.c
@@ -60,6 +83,9 @@ noreturn void panic(char *);
 int exec(char *, char **);
 
 // fs.c
+void begin_op(void);
+void log_sync(void);
+void end_op(void);
 void readsb(int dev, struct superblock *sb);
 struct inode *dirlookup(struct inode *, char *, uint *);
 struct inode *rootlookup(char *);
@@ -75,22 +101,31 @@ struct inode *iopen(char *);
 struct inode *concurrent_icreate(char *);
 struct inode *icreate(char *);
 int iunlink(char *);
+void itrim(struct inode *);
 int concurrent_readi(struct inode *, char *, uint, uint);
 int readi(struct inode *, char *, uint, uint);
+int concurrent_readi_ahead(struct inode *, char *, uint, uint, struct readahead *);
+void readahead(struct inode *, struct readahead *, uint, uint);
 void concurrent_stati(struct inode *, struct stat *);
 void stati(struct inode *, struct stat *);
 int concurrent_writei(struct inode *, char *, uint, uint);
 int writei(struct inode *, char *, uint, uint);
-int writei_file(struct inode *, char *, int, int, int);
-int writei_append(struct inode *, char *, int, int, int, int);
 int log_concurrent_writei(struct inode *, char *, uint, uint);
-int log_writei_file(struct inode *, char *, int, int, int);
-int log_writei_append(struct inode *, char *, int, int, int, int);
 
 // ide.c
+extern int ideirq;
+
 void ideinit(void);
 void ideintr(void);
 void iderw(struct buf *);
+void iderw_submit(struct buf *);
+void iderw_wait(struct buf *);
+
+// iosched.c
+void ioqinit(struct ioqueue *, struct iosched *);
+int ioqempty(struct ioqueue *);
+void ioqadd(struct ioqueue *, struct buf *);
+struct buf *ioqnext(struct ioqueue *, int);
 
 // ioapic.c
 void ioapicenable(int irq, int cpu);
@@ -147,6 +182,13 @@ void vspacedumpcode(struct vspace *);
 int vregionaddmap(struct vregion *, uint64_t, uint64_t, short, short);
 int vregiondelmap(struct vregion *, uint64_t, uint64_t);
 
+// pci.c
+uint pciconfread(struct pcifunc *, uint);
+void pciconfwrite(struct pcifunc *, uint, uint);
+void pcienable(struct pcifunc *, uint);
+int pcifinddev(ushort, ushort, struct pcifunc *);
+int pcifindclass(uchar, uchar, struct pcifunc *);
+
 // picirq.c
 void picenable(int);
 void picinit(void);
@@ -168,6 +210,7 @@ void yield(void);
 void reboot(void);
 int sbrk(int);
 int get_child_number(struct proc *);
+int kthread_create(char *, void (*)(void));
 
 
 // swtch.S
@@ -229,3 +272,4 @@ int file_write(int, char *, int);
 int file_dup(int);
 int file_stat(int, struct stat *);
 int file_unlink(char *);
+int file_lseek(int, int, int);
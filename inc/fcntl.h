@@ -4,3 +4,8 @@
 #define O_WRONLY 0x001
 #define O_RDWR 0x002
 #define O_CREATE 0x200
+
+// lseek whence
+#define SEEK_SET 0 // from the start of the file
+#define SEEK_CUR 1 // from the current position
+#define SEEK_END 2 // from the end of the file
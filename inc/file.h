@@ -5,6 +5,13 @@
 
 #define PIPE_BUFFER_SIZE 2048
 
+// sequential readahead state of an open file
+struct readahead {
+  uint next;   // offset a sequential read would start at
+  uint ahead;  // offset up to which blocks have been prefetched
+  uint window; // blocks to prefetch past the current read
+};
+
 // an abstraction on top of inodes
 // allows for an I/O interface for user processes
 struct file_info {
@@ -17,6 +24,7 @@ struct file_info {
   uint ref_count;
   char *path;
   uint gfd; // global file descriptor (in global file table)
+  struct readahead ra;
 };
 
 
@@ -38,12 +46,24 @@ struct inode {
   int ref;   // Reference count
   int valid; // Flag for if node is valid
   struct sleeplock lock;
+  struct inode *prev; // LRU list of unreferenced inodes
+  struct inode *next;
+  struct inode *hnext; // hash chain
 
   // copy of disk inode (see fs.h for details)
   short type;
   short devid;
   uint size;
   struct extent data[EXTENTS];
+  uint indirect;
+  short flags;
+
+  // derived from the extents when the inode is read
+  uint nextents;      // extents in use in data
+  uint lblk[EXTENTS]; // file block number each of them starts at
+  uint nblocks;       // blocks allocated to the file
+
+  uint dirfree; // directory: every entry before this offset is in use
 };
 
 // table mapping device ID (devid) to device functions
@@ -8,13 +8,18 @@
 
 #define INODEFILEINO 0 // inode file inum
 #define ROOTINO 1      // root i-number
-#define BSIZE 512      // block size
+
+// Block size.  Set with BSIZE= on the make command line (default
+// 4096, one page); mkfs records it in the superblock.
+#ifndef BSIZE
+#define BSIZE 4096
+#endif
 
 #define LOG_VALID 1  // log was committed
 #define LOG_INVALID 0 // log was not committed
 
 // Disk layout:
-// [ boot block | super block | free bit map | log |
+// [ boot block | super block | free bit map | log header | log |
 //                                          inode file | data blocks]
 //
 // mkfs computes the super block and builds an initial file system. The
@@ -25,29 +30,72 @@ struct superblock {
   uint bmapstart;  // Block number of first free map block
   uint logstart;   // Block number of first log block
   uint inodestart; // Block number of the start of inode file
+  uint bsize;      // Block size (bytes)
+  uint nlog;       // Number of log blocks, not counting the header
 };
 
+// Most log blocks one header block can describe
+#define MAXLOGSIZE (BSIZE / sizeof(int) - 2)
+
 struct logheader {
   int commit;  // 1 if the log was committed, 0 otherwise
   int size;    // Number of blocks in the log
-  int disk_loc[LOGSIZE]; // Disk locations of the blocks in the log
-  char pad[BSIZE - 2 * sizeof(int) - LOGSIZE * sizeof(int)];
+  int disk_loc[MAXLOGSIZE]; // Disk locations of the blocks in the log
 };
 
 // On-disk inode structure
-// bytes = 2 + 2 + 4 + 30 * 8 = 248
-// pad to make it a power of 2 --> +8 --> 256
+// bytes = 2 + 2 + 4 + 30 * 8 + 4 + 2 = 254
+// pad to make it a power of 2 --> +2 --> 256
 struct dinode {
   short type;         // File type (device, directory, regular file)
   short devid;        // Device number (T_DEV only)
   uint size;          // Size of file (bytes)
   struct extent data[EXTENTS]; // Data blocks of file on disk
-  char pad[8];       // So disk inodes fit contiguosly in a block
+  uint indirect;      // Index block of further extents, 0 if none
+  short flags;        // I_DXDIR if a directory has a hash index
+  char pad[2];       // So disk inodes fit contiguosly in a block
+};
+
+// Extent tree.  A file's first EXTENTS extents are in its dinode.
+// The rest are in leaf blocks, found through a single index block
+// named by dinode.indirect.  Entries in both kinds of block are
+// tagged with the file block they start at and kept in file
+// order, so finding the extent for a block is a binary search of
+// the index and then of one leaf.  An extent with startblkno 0 is
+// a hole: its blocks read as zeros and are not allocated.
+
+// An extent in a leaf block.
+struct iextent {
+  uint lblk;       // file block number of the extent's first block
+  struct extent e;
+};
+
+#define NLEAFEXTENTS ((BSIZE - sizeof(uint)) / sizeof(struct iextent))
+
+struct extentleaf {
+  uint n;          // extents in use
+  struct iextent e[NLEAFEXTENTS];
+};
+
+// An entry in the index block.
+struct extentidx {
+  uint lblk;       // file block number the leaf's first extent starts at
+  uint blkno;      // block number of the leaf
+};
+
+#define NINDEXLEAVES ((BSIZE - sizeof(uint)) / sizeof(struct extentidx))
+
+struct extentindex {
+  uint n;          // leaves in use
+  struct extentidx leaf[NINDEXLEAVES];
 };
 
 // offset of inode in inodefile
 #define INODEOFF(inum) ((inum) * sizeof(struct dinode))
 
+// Inodes per block
+#define IPB (BSIZE / sizeof(struct dinode))
+
 // Bitmap bits per block
 #define BPB (BSIZE * 8)
 
@@ -61,3 +109,38 @@ struct dirent {
   ushort inum;
   char name[DIRSIZ];
 };
+
+// Directory entries per block
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// Indexed directories.  A directory that outgrows its first block
+// gets a hash index and I_DXDIR in its dinode's flags.  Block 0
+// becomes a dxblock listing, in hash order, the lowest name hash
+// each of the other blocks, the leaves, is for; a name is in the
+// leaf whose range its hash falls in.  Leaves are ordinary blocks
+// of dirents.  Every 16-byte slot of the index starts with a zero
+// inum, so programs that read a directory as an array of dirents
+// see only free entries there and still find every name.
+#define I_DXDIR 0x1
+
+#define DX_MAGIC 0x78646978 // "xidx"
+
+struct dxentry {
+  ushort zero; // always 0: a free dirent to linear readers
+  ushort pad;
+  uint hash;   // lowest name hash in the leaf
+  uint lblk;   // directory block holding the leaf
+  uint pad2;
+};
+
+// Leaves an index can list, after its header slot
+#define NDXLEAF (BSIZE / sizeof(struct dxentry) - 1)
+
+struct dxblock {
+  ushort zero;
+  ushort pad;
+  uint magic; // DX_MAGIC
+  uint nleaf; // entries in use in e; e[0].hash is 0
+  uint pad2;
+  struct dxentry e[NDXLEAF];
+};
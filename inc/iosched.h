@@ -0,0 +1,30 @@
+#pragma once
+
+struct buf;
+struct ioqueue;
+
+// A disk scheduling policy picks which pending request the
+// driver starts next.
+struct iosched {
+  char *name;
+  struct buf *(*pick)(struct ioqueue *);
+};
+
+#define IOQ_READ 0
+#define IOQ_WRITE 1
+
+// Requests waiting for a disk.  Reads and writes are kept apart,
+// each both sorted by (dev, blockno) and in arrival order.
+// Protected by the driver's lock.
+struct ioqueue {
+  struct iosched *sched;
+  struct buf *sorted[2];     // by dev and blockno, linked by qnext/qprev
+  struct buf *sortedtail[2];
+  struct buf *fifo[2];       // by arrival, linked by fnext/fprev
+  struct buf *fifotail[2];
+  uint dev;                  // where the last started request ended
+  uint blockno;
+};
+
+extern struct iosched iosched_elevator;
+extern struct iosched iosched_deadline;
@@ -5,14 +5,22 @@
 #define NCPU 8         // maximum number of CPUs
 #define NOFILE 16      // open files per process
 #define NFILE 100      // open files per system
-#define NINODE 50      // maximum number of active i-nodes
+#define NINODE 50      // minimum size of the inode cache
+#define NDCACHE 256    // directory entries cached for path lookup
 #define NDEV 10        // maximum major device number
 #define ROOTDEV 1      // device number of file system root disk
 #define MAXARG 32      // max exec arguments
-#define MAXOPBLOCKS 10 // max # of blocks any FS op writes
+#define MAXOPBLOCKS 20 // max # of blocks any FS op writes
 
-#define LOGSIZE (MAXOPBLOCKS * 3) // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 3)    // size of disk block cache
-#define FSSIZE 50000             // size of file system in blocks
+#define LOGSIZE (MAXOPBLOCKS * 3) // default data blocks in on-disk log (mkfs -l)
+#define NBUF (MAXOPBLOCKS * 6)    // minimum size of disk block cache
+#define BCACHE_SHARE 16           // disk block cache gets 1/16 of free pages
+#define ICACHE_SHARE 256          // inode cache gets 1/256 of free pages
+#define CHECKPOINT_INTERVAL 100   // ticks between background checkpoints
+#define RA_MINBLOCKS 4            // initial sequential readahead window
+#define RA_MAXBLOCKS 64           // largest sequential readahead window
+#define MAXPREALLOC 64            // most blocks an append preallocates
+#define IOSCHED iosched_deadline  // disk scheduling policy; iosched_elevator can starve writes
+#define FSSIZE (25600000 / BSIZE) // size of file system in blocks
 #define MAXCODEPAGES 256
 #define MAXPATHLEN 20
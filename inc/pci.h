@@ -0,0 +1,29 @@
+#pragma once
+
+// A PCI function found by the bus scan in pci.c.
+struct pcifunc {
+  uint bus;
+  uint dev;
+  uint func;
+  ushort vendor;
+  ushort device;
+  uchar class;
+  uchar subclass;
+  uchar progif;
+  uchar irq;     // interrupt line, as set up by the BIOS
+  uint bar[6];   // base address registers, type bits included
+};
+
+#define PCI_CONF_COMMAND 0x04
+#define PCI_CONF_BAR0 0x10
+#define PCI_CONF_INTR 0x3c
+
+#define PCI_COMMAND_IO 0x1     // respond to I/O space accesses
+#define PCI_COMMAND_MEM 0x2    // respond to memory space accesses
+#define PCI_COMMAND_MASTER 0x4 // may act as bus master (DMA)
+
+#define PCI_BAR_IO 0x1                // BAR maps I/O ports
+#define PCI_BAR_IOADDR(bar) ((bar) & ~0x3)
+
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
@@ -90,6 +90,7 @@ struct proc {
   int killed;                      // If non-zero, have been killed
   char name[16];                   // Process name (debugging)
   struct file_info *files[NOFILE]; // Files
+  void (*kentry)(void);            // Entry point if this is a kernel thread
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -5,5 +5,16 @@ struct sys_info {
   int pages_in_swap;
   int free_pages;
   int num_page_faults;
-  int num_disk_reads;
+  int num_disk_reads;       // blocks read from disk, not cache hits
+  int num_bcache_hits;      // buffer cache lookups that found the block
+  int num_bcache_misses;    // buffer cache lookups that did not
+  int num_bcache_evictions; // cached blocks replaced by other blocks
+  int num_dirty_writebacks; // dirty buffers written back to disk
+  int num_disk_cmds;        // commands issued to the disk
+  int num_disk_sectors;     // sectors transferred to or from the disk
+  int io_wait_ticks;        // ticks processes spent waiting for disk reads and flushes
+  int num_icache_hits;      // inode cache lookups that found the inode
+  int num_icache_misses;    // inode cache lookups that did not
+  int num_dcache_hits;      // directory lookups answered by the dcache
+  int num_dcache_misses;    // directory lookups that read the directory
 };
@@ -28,6 +28,8 @@ int sleep(int);
 int uptime(void);
 int sysinfo(struct sys_info *);
 int crashn(int);
+int lseek(int, int, int);
+int sync(void);
 
 // ulib.c
 int stat(char *, struct stat *);
@@ -11,6 +11,20 @@ static inline uchar inb(ushort port) {
   return data;
 }
 
+static inline ushort inw(ushort port) {
+  ushort data;
+
+  asm volatile("in %1,%0" : "=a"(data) : "d"(port));
+  return data;
+}
+
+static inline uint inl(ushort port) {
+  uint data;
+
+  asm volatile("in %1,%0" : "=a"(data) : "d"(port));
+  return data;
+}
+
 static inline void insl(int port, void *addr, int cnt) {
   asm volatile("cld; rep insl"
                : "=D"(addr), "=c"(cnt)
@@ -26,6 +40,10 @@ static inline void outw(ushort port, ushort data) {
   asm volatile("out %0,%1" : : "a"(data), "d"(port));
 }
 
+static inline void outl(ushort port, uint data) {
+  asm volatile("out %0,%1" : : "a"(data), "d"(port));
+}
+
 static inline void outsl(int port, const void *addr, int cnt) {
   asm volatile("cld; rep outsl"
                : "=S"(addr), "=c"(cnt)
@@ -47,6 +65,14 @@ static inline void stosl(void *addr, int data, int cnt) {
                : "memory", "cc");
 }
 
+// Read the CPU's time-stamp counter.
+static inline uint64_t rdtsc(void) {
+  uint lo, hi;
+
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
 struct segdesc;
 
 static inline void lgdt(struct segdesc *p, int size) {
@@ -1,27 +1,51 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to mark it dirty,
+//     then bflush (or bflush_async) to write it out.
 // * When done with the buffer, call brelse.
+// * To keep several requests in flight, start them with bread_async
+//     or bflush_async and call bwait on each buffer before using it.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 //
-// The implementation uses two state flags internally:
+// The implementation uses three state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_LOGGED: the buffer holds changes of a transaction that
+//     has not been checkpointed yet; the log code sets and
+//     clears it.
+//
+// Every change to a block goes through the log, which writes its
+// log slots and, at checkpoint, its home blocks with bflush, so a
+// buffer is never left dirty.  Buffers marked B_LOGGED are never
+// recycled: the log decides when their contents may reach their
+// home location on disk.
+//
+// bprefetch asks a kernel thread, the prefetcher, to read
+// blocks into the cache ahead of use.  The caller does not wait;
+// the blocks are simply there (or being read) when bread asks.
+//
+// Buffers are found through a hash table keyed on (dev, blockno).
+// Buffers nobody holds a reference to are also kept on an LRU
+// list, so picking a buffer to recycle does not have to walk
+// the whole cache.  The number of buffers is chosen at boot from
+// the amount of free memory (see BCACHE_SHARE in param.h).
 
 #include <cdefs.h>
 #include <defs.h>
 #include <fs.h>
+#include <mmu.h>
 #include <param.h>
+#include <proc.h>
 #include <sleeplock.h>
 #include <spinlock.h>
 
@@ -30,32 +54,165 @@
 int crashn_enable = 0;
 int crashn = 0;
 
-int num_disk_reads = 0;
+// Statistics for sysinfo.
+int num_disk_reads = 0;       // blocks read from disk
+int num_bcache_hits = 0;      // bget found the block cached
+int num_bcache_misses = 0;    // bget had to take a buffer for the block
+int num_bcache_evictions = 0; // valid blocks pushed out of the cache
+int num_dirty_writebacks = 0; // dirty buffers written to disk
+int num_disk_cmds = 0;        // commands issued by the disk driver
+int num_disk_sectors = 0;     // sectors the disk driver transferred
+int io_wait_ticks = 0;        // ticks processes spent waiting for bread and bflush
+
+#define NBUCKET 1021 // hash buckets, prime
+#define NPREFETCH 16 // queued readahead requests
+#define NIOBATCH 32  // reads the prefetcher keeps in flight
+#define BHASH(dev, blockno) ((((dev) << 24) ^ (blockno)) % NBUCKET)
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  int nbuf;
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  // Hash chains of all buffers holding a block, through hnext.
+  struct buf *hash[NBUCKET];
+
+  // Linked list of unreferenced buffers, through prev/next.
+  // lru.next is most recently used.
+  struct buf lru;
+
+  // Ring of block ranges waiting for the prefetcher.
+  struct {
+    uint dev;
+    uint blockno;
+    uint n;
+  } prefetch[NPREFETCH];
+  uint prefetch_head; // next request the prefetcher takes
+  uint prefetch_tail; // next free slot
 } bcache;
 
+// Unlink b from the LRU list.  Caller must hold bcache.lock.
+static void lru_remove(struct buf *b) {
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  b->next = b->prev = 0;
+}
+
+// Put b at the most recently used end of the LRU list.
+// Caller must hold bcache.lock.
+static void lru_push(struct buf *b) {
+  b->next = bcache.lru.next;
+  b->prev = &bcache.lru;
+  bcache.lru.next->prev = b;
+  bcache.lru.next = b;
+}
+
+// Unlink b from its hash chain, if it is on one.
+// Caller must hold bcache.lock.
+static void hash_remove(struct buf *b) {
+  struct buf **pp;
+
+  for (pp = &bcache.hash[BHASH(b->dev, b->blockno)]; *pp; pp = &(*pp)->hnext) {
+    if (*pp == b) {
+      *pp = b->hnext;
+      break;
+    }
+  }
+  b->hnext = 0;
+}
+
 void binit(void) {
-  struct buf *b;
+  struct buf *b, *hdrs;
+  uchar *page;
+  int want, nhdrs, off;
 
   initlock(&bcache.lock, "bcache");
+  bcache.lru.prev = &bcache.lru;
+  bcache.lru.next = &bcache.lru;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Give the cache a fixed share of the pages mem_init() found free.
+  want = free_pages / BCACHE_SHARE * (PGSIZE / BSIZE);
+  if (want < NBUF)
+    want = NBUF;
+
+  // Buffer headers and buffer data are carved out of separate pages.
+  hdrs = 0;
+  page = 0;
+  nhdrs = 0;
+  off = PGSIZE;
+  while (bcache.nbuf < want) {
+    if (off + BSIZE > PGSIZE) {
+      if ((page = (uchar *)kalloc()) == 0)
+        break;
+      off = 0;
+    }
+    if (nhdrs == 0) {
+      if ((hdrs = (struct buf *)kalloc()) == 0)
+        break;
+      nhdrs = PGSIZE / sizeof(struct buf);
+    }
+    b = hdrs++;
+    nhdrs--;
+    memset(b, 0, sizeof(*b));
+    b->data = page + off;
+    off += BSIZE;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    lru_push(b);
+    bcache.nbuf++;
+  }
+
+  if (bcache.nbuf < NBUF)
+    panic("binit: not enough memory for buffers");
+  cprintf("bcache: %d buffers\n", bcache.nbuf);
+}
+
+// Start writing dirty, locked buffer b to disk.
+static void bwrite_start(struct buf *b) {
+  if (crashn_enable) {
+    crashn--;
+    if (crashn < 0)
+      reboot();
   }
+
+  // b stays locked until the write is done, so nobody can
+  // dirty it again in between.
+  num_dirty_writebacks++;
+  iderw_submit(b);
+}
+
+// Is the block cached (or being read into the cache)?
+// Caller must hold bcache.lock.
+static int bcached(uint dev, uint blockno) {
+  struct buf *b;
+
+  for (b = bcache.hash[BHASH(dev, blockno)]; b != 0; b = b->hnext)
+    if (b->dev == dev && b->blockno == blockno)
+      return 1;
+  return 0;
+}
+
+// Take the least recently used clean buffer for block blockno
+// of dev.  Returns it referenced but unlocked, or 0 if every
+// unreferenced buffer is pinned by the log.  Caller must hold
+// bcache.lock.
+static struct buf *brecycle(uint dev, uint blockno) {
+  struct buf *b;
+
+  for (b = bcache.lru.prev; b != &bcache.lru; b = b->prev) {
+    if ((b->flags & (B_DIRTY | B_LOGGED)) == 0) {
+      if (b->flags & B_VALID)
+        num_bcache_evictions++;
+      lru_remove(b);
+      hash_remove(b);
+      b->dev = dev;
+      b->blockno = blockno;
+      b->flags = 0;
+      b->refcnt = 1;
+      b->hnext = bcache.hash[BHASH(dev, blockno)];
+      bcache.hash[BHASH(dev, blockno)] = b;
+      return b;
+    }
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -67,57 +224,126 @@ static struct buf *bget(uint dev, uint blockno) {
   acquire(&bcache.lock);
 
   // Is the block already cached?
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+  for (b = bcache.hash[BHASH(dev, blockno)]; b != 0; b = b->hnext) {
     if (b->dev == dev && b->blockno == blockno) {
-      b->refcnt++;
+      if (b->refcnt++ == 0)
+        lru_remove(b);
+      num_bcache_hits++;
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
   }
 
-  // Not cached; recycle some unused buffer and clean buffer
-  // "clean" because B_DIRTY and not locked means log.c
-  // hasn't yet committed the changes to the buffer.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-    if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Not cached; recycle the least recently used clean buffer.
+  if ((b = brecycle(dev, blockno)) == 0)
+    panic("bget: no buffers");
+  num_bcache_misses++;
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Like bget, but only for a block that is not cached yet, and
+// without waiting for a buffer to be written back.  Returns 0
+// if the block is cached or no clean buffer is free.
+static struct buf *bgetnew(uint dev, uint blockno) {
+  struct buf *b;
+
+  acquire(&bcache.lock);
+  if (bcached(dev, blockno) || (b = brecycle(dev, blockno)) == 0) {
+    release(&bcache.lock);
+    return 0;
   }
-  panic("bget: no buffers");
+  release(&bcache.lock);
+
+  // Nobody else can hold the lock of a freshly recycled buffer.
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Wait for the I/O started on b, counting the time as I/O wait
+// unless a kernel thread (the checkpointer) is the one waiting.
+static void biowait(struct buf *b) {
+  struct proc *p = myproc();
+  uint ticks0 = ticks;
+
+  iderw_wait(b);
+  if (p == 0 || p->kentry == 0)
+    io_wait_ticks += ticks - ticks0;
 }
 
 // Return a locked buf with the contents of the indicated block.
 struct buf *bread(uint dev, uint blockno) {
-  num_disk_reads += 1;
   struct buf *b;
 
   b = bget(dev, blockno);
   if (!(b->flags & B_VALID)) {
-    iderw(b);
+    num_disk_reads += 1;
+    iderw_submit(b);
+    biowait(b);
   }
   return b;
 }
 
-// Write b's contents to disk.  Must be locked.
-void bwrite(struct buf *b) {
-  if (crashn_enable) {
-    crashn--;
-    if (crashn < 0)
-      reboot();
+// Return a locked buf for the indicated block, with a read
+// from disk started if it is not cached.  Call bwait before
+// looking at the data.
+struct buf *bread_async(uint dev, uint blockno) {
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if (!(b->flags & B_VALID)) {
+    num_disk_reads += 1;
+    iderw_submit(b);
   }
+  return b;
+}
+
+// Return a locked buf for the indicated block without reading
+// it from disk, for a caller about to overwrite all of it.
+struct buf *bgetblk(uint dev, uint blockno) {
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Mark b's contents as modified.  Must be locked.
+// Call bflush or bflush_async before releasing it.
+void bwrite(struct buf *b) {
   if (!holdingsleep(&b->lock))
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
 }
 
+// Start writing b to disk if it is dirty, without waiting.
+// Must be locked; call bwait before changing or releasing it.
+void bflush_async(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("bflush");
+  if (b->flags & B_DIRTY)
+    bwrite_start(b);
+}
+
+// Write b's contents to disk now if it is dirty.  Must be locked.
+void bflush(struct buf *b) {
+  bflush_async(b);
+  biowait(b);
+}
+
+// Wait for the I/O started on b by bread_async or bflush_async.
+// Must be locked.
+void bwait(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("bwait");
+  biowait(b);
+}
+
+// Number of buffers in the cache.
+int bcachesize(void) { return bcache.nbuf; }
+
 // Release a locked buffer.
 // Move to the head of the MRU list.
 void brelse(struct buf *b) {
@@ -130,27 +356,83 @@ void brelse(struct buf *b) {
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    lru_push(b);
   }
 
   release(&bcache.lock);
 }
 
+// Ask the prefetcher to read blocks [blockno, blockno + n) of dev
+// into the cache.  Does not wait.  Readahead is only a hint, so
+// the request is dropped if the queue is full.
+void bprefetch(uint dev, uint blockno, uint n) {
+  if (n == 0)
+    return;
+
+  acquire(&bcache.lock);
+  if (bcache.prefetch_tail - bcache.prefetch_head < NPREFETCH) {
+    uint i = bcache.prefetch_tail++ % NPREFETCH;
+    bcache.prefetch[i].dev = dev;
+    bcache.prefetch[i].blockno = blockno;
+    bcache.prefetch[i].n = n;
+    wakeup(&bcache.prefetch);
+  }
+  release(&bcache.lock);
+}
+
+// Body of the prefetcher thread.  Starts the reads of up to
+// NIOBATCH missing blocks, then waits for all of them, so the
+// disk queue stays full while the reader carries on.
+static void prefetcher(void) {
+  struct buf *b, *batch[NIOBATCH];
+  uint dev, blockno, n, i;
+  int nb, j;
+
+  for (;;) {
+    acquire(&bcache.lock);
+    while (bcache.prefetch_head == bcache.prefetch_tail)
+      sleep(&bcache.prefetch, &bcache.lock);
+
+    i = bcache.prefetch_head++ % NPREFETCH;
+    dev = bcache.prefetch[i].dev;
+    blockno = bcache.prefetch[i].blockno;
+    n = bcache.prefetch[i].n;
+    release(&bcache.lock);
+
+    nb = 0;
+    for (i = 0; i < n; i++) {
+      if ((b = bgetnew(dev, blockno + i)) != 0) {
+        num_disk_reads += 1;
+        iderw_submit(b);
+        batch[nb++] = b;
+      }
+      if (nb == NIOBATCH || (i == n - 1 && nb > 0)) {
+        for (j = 0; j < nb; j++) {
+          iderw_wait(batch[j]);
+          brelse(batch[j]);
+        }
+        nb = 0;
+      }
+    }
+  }
+}
+
+// Start the prefetcher thread.
+void bprefetchinit(void) {
+  if (kthread_create("bprefetch", prefetcher) < 0)
+    panic("bprefetchinit");
+}
+
 // Print the data at the given block.
 // Format: block_no, byte index, data
 // Note: Data stored in blocks on disk are in little endian.
 void print_data_at_block(uint block) {
   cprintf("Printing data at block=%d\n", block);
-  uint64_t data[BSIZE / 8];
+  // A block can be a page, too big to copy onto the kernel stack.
   struct buf *b = bread(ROOTDEV, block);
-  memmove(data, b->data, BSIZE);
-  brelse(b);
+  uint64_t *data = (uint64_t *)b->data;
   for (int i = 0; i < BSIZE / 8; ++i) {
     cprintf("block=0x%x index=%d: %lx\n", block, i, data[i]);
   }
+  brelse(b);
 }
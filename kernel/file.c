@@ -18,6 +18,11 @@
 
 struct devsw devsw[NDEV];
 
+// file_table_lock protects the table's slots and reference
+// counts.  It is never held across a file system operation, so
+// that operations on different files can share a transaction
+// (see begin_op); each file_info's own lock serializes the
+// reads, writes and seeks that use its offset.
 static struct file_info file_table[NFILE];
 struct sleeplock file_table_lock;
 
@@ -48,13 +53,28 @@ int file_open(int access_mode, char *path) {
         ++global_ftable_index;   
     }
 
+    if (global_ftable_index == NFILE) {
+        cprintf("[ERROR] file_open: global file table is full\n");
+        releasesleep(&file_table_lock);
+        return -1;
+    }
+
+    // Claim both entries, then look up or create the file without
+    // the table lock
+    file_table[global_ftable_index].ref_count = 1;
+    my_proc->files[proc_ftable_index] = &file_table[global_ftable_index];
+    releasesleep(&file_table_lock);
+
     struct inode *inode_ptr = iopen(path);
     if (inode_ptr == NULL && (access_mode & 0xF00) == O_CREATE) {
         inode_ptr = concurrent_icreate(path);
     }
 
+    acquiresleep(&file_table_lock);
     if (inode_ptr == NULL) {
         cprintf("[ERROR] file_open: could not open inode\n");
+        file_table[global_ftable_index].ref_count = 0;
+        my_proc->files[proc_ftable_index] = NULL;
         releasesleep(&file_table_lock);
         return -1;
     }
@@ -69,8 +89,7 @@ int file_open(int access_mode, char *path) {
       .path=path,
       .gfd=global_ftable_index
     };
-
-    my_proc->files[proc_ftable_index] = &file_table[global_ftable_index];
+    initsleeplock(&file_table[global_ftable_index].lock, "file");
     releasesleep(&file_table_lock);
 
     return proc_ftable_index;
@@ -161,12 +180,33 @@ int file_write(int fd, char *buf, int nr_bytes) {
     return pipe_write(fd, buf, nr_bytes);
   }
 
-  acquiresleep(&file_table_lock);
-  int offset = log_concurrent_writei(file->node, buf, file->offset, nr_bytes);
-
-  my_proc->files[fd]->offset += offset;
-  releasesleep(&file_table_lock);
-  return offset;
+  // Write at most max bytes per file system operation, so that
+  // one operation never logs more than MAXOPBLOCKS blocks: the
+  // data blocks (one more if the write is unaligned, and the old
+  // last block if it leaves a hole), the bitmap blocks of the new
+  // run (two if it crosses a bitmap block boundary), an inodefile
+  // block, up to three extent leaves (filling a hole may split
+  // one) and the index block, and the bitmap blocks of a new leaf
+  // or index.
+  int max = (MAXOPBLOCKS - 12) * BSIZE;
+  int total = 0;
+
+  acquiresleep(&file->lock);
+  while (total < nr_bytes) {
+    int n = min(nr_bytes - total, max);
+    int r = log_concurrent_writei(file->node, buf + total, file->offset, n);
+    if (r < 0) {
+      if (total == 0)
+        total = -1;
+      break;
+    }
+    file->offset += r;
+    total += r;
+    if (r != n)
+      break;
+  }
+  releasesleep(&file->lock);
+  return total;
 }
 
 
@@ -211,17 +251,19 @@ int file_read(int fd, char *buf, int nr_bytes) {
     return pipe_read(fd, buf, nr_bytes);
   }
 
-  acquiresleep(&file_table_lock);
-  int offset = concurrent_readi(fi->node, buf, fi->offset, nr_bytes);
+  acquiresleep(&fi->lock);
+  int offset = concurrent_readi_ahead(fi->node, buf, fi->offset, nr_bytes, &fi->ra);
 
   my_proc->files[fd]->offset += offset;
-  releasesleep(&file_table_lock);
+  releasesleep(&fi->lock);
   return offset;
 }
 
 int file_close(int fd) {
   struct proc *my_proc = myproc();
   struct file_info *fi = my_proc->files[fd];
+  struct inode *node = NULL;
+  int trim = 0;
 
   acquiresleep(&file_table_lock);
   if (fi->isPipe) {
@@ -263,10 +305,8 @@ int file_close(int fd) {
     // Clean up if this is the last reference to the file_info
     // cprintf("file_close: ref_count = %d\n", fi->ref_count);
     if (--fi->ref_count <= 0) {
-        // Release the inode if this is the last reference to it
-        irelease(fi->node);
-        //cprintf("file_close: inode ref = %d\n", fi->node->ref);
-          
+        node = fi->node;
+        trim = fi->mode != O_RDONLY;
         *fi = (struct file_info) { 0 };
     }
   }
@@ -275,6 +315,20 @@ int file_close(int fd) {
   my_proc->files[fd] = NULL;
 
   releasesleep(&file_table_lock);
+
+  if (node != NULL) {
+    // Give back the blocks appends preallocated but did not use
+    if (trim) {
+      begin_op();
+      locki(node);
+      itrim(node);
+      unlocki(node);
+      end_op();
+    }
+
+    // Release the inode if this is the last reference to it
+    irelease(node);
+  }
   return 0;
 }
 
@@ -346,6 +400,41 @@ int pipe(int *fd_arr) {
 }
 
 int file_unlink(char *path) {
-  return iunlink(path);
+  int r;
+
+  begin_op();
+  r = iunlink(path);
+  end_op();
+  return r;
 }
 
+int file_lseek(int fd, int offset, int whence) {
+  struct file_info *fi = myproc()->files[fd];
+  struct stat st;
+  int base;
+
+  if (fi == NULL || fi->isPipe || fi->node == NULL)
+    return -1;
+
+  acquiresleep(&fi->lock);
+  concurrent_stati(fi->node, &st);
+  if (st.type == T_DEV) {
+    releasesleep(&fi->lock);
+    return -1;
+  }
+  if (whence == SEEK_SET)
+    base = 0;
+  else if (whence == SEEK_CUR)
+    base = fi->offset;
+  else if (whence == SEEK_END)
+    base = st.size;
+  else
+    base = -1;
+  if (base < 0 || base + offset < 0) {
+    releasesleep(&fi->lock);
+    return -1;
+  }
+  fi->offset = base + offset;
+  releasesleep(&fi->lock);
+  return fi->offset;
+}
@@ -18,6 +18,7 @@
 #include <sleeplock.h>
 #include <spinlock.h>
 #include <stat.h>
+#include <x86_64.h>
 
 #include <buf.h>
 
@@ -26,136 +27,343 @@
 struct superblock sb;
 
 // Log API
+//
+// File system operations are bracketed by begin_op() and end_op().
+// Operations running at the same time share one transaction,
+// which commits when the last of them ends (group commit).  An
+// operation may log up to MAXOPBLOCKS blocks; begin_op() waits
+// while the log might not have room for that, or while a commit
+// is in progress.
+//
+// The header of the running transaction is kept in memory.  A
+// logged block stays in its (pinned) home buffer until commit,
+// so writing the same block twice in one transaction takes one
+// log slot, and the on-disk header is written only by
+// log_commit_tx().
+//
+// Commit returns as soon as the commit record is on disk.  The
+// home buffers of committed transactions stay pinned in the
+// cache, where reads find them, and later transactions append
+// to the log after them.  Installing them at home (checkpointing)
+// happens later: by the checkpointer thread when the file system
+// is idle, or by begin_op() when the log has run out of room.
+// A block logged by several committed transactions is installed
+// once.
+//
+// The log holds sb.nlog blocks, set by mkfs; see MAXLOGSIZE.
+// Since logged blocks are pinned, a transaction is also kept
+// small enough to leave the buffer cache room to work in.
 
-// Begin a log transaction
-static void log_begin_tx() {
-  struct buf* log_header_buf = bread(ROOTDEV, sb.logstart);
-
-  struct logheader log_header;
-  log_header.commit = LOG_INVALID;
-  log_header.size = 0;
+#define LOGBATCH 32 // log blocks in flight at a time during commit
 
-  memmove(&log_header_buf->data, &log_header, sizeof(log_header));
+static_assert(NBUF - LOGBATCH - MAXOPBLOCKS >= LOGSIZE,
+              "NBUF too small to pin a full default log");
 
-  bwrite(log_header_buf);
-  brelse(log_header_buf);
+struct {
+  struct spinlock lock;
+  int nlog;              // log blocks on disk
+  int outstanding;       // operations in the running transaction
+  int committing;        // in log_commit_tx() or log_checkpoint(), wait
+  int committed;         // slots of committed, not checkpointed transactions
+  int size;              // slots in use, the running transaction's last
+  int disk_loc[MAXLOGSIZE]; // home block of each log slot
+} log;
+
+static void log_commit_tx();
+static void log_checkpoint();
+
+// Checkpoint with log.lock held, no operation running and no
+// commit in progress.  Releases log.lock while installing.
+static void checkpoint_locked(void) {
+  log.committing = 1;
+  release(&log.lock);
+  log_checkpoint();
+  acquire(&log.lock);
+  log.committing = 0;
+  wakeup(&log);
 }
 
-// Write a block to the log
-static void log_write(struct buf* buf) {
-  struct buf* log_header_buf = bread(ROOTDEV, sb.logstart);
-
-  struct logheader log_header;
-  memmove(&log_header, &log_header_buf->data, sizeof(struct logheader));
+// Log slots that may be in use at once.  Each one pins a buffer
+// until checkpoint, so besides the log's size this leaves
+// LOGBATCH buffers free for write_log() and MAXOPBLOCKS for the
+// blocks operations read.
+static int log_limit(void) {
+  return min(log.nlog, bcachesize() - LOGBATCH - MAXOPBLOCKS);
+}
 
-  if (log_header.commit != LOG_INVALID) {
-    panic("log_write: writing to log when commit is not invalid");
+// Begin a file system operation.  Call before locking any inode
+// it will modify.
+void begin_op(void) {
+  acquire(&log.lock);
+  for (;;) {
+    if (log.committing) {
+      sleep(&log, &log.lock);
+    } else if (log.size + (log.outstanding + 1) * MAXOPBLOCKS > log_limit()) {
+      // This op might exhaust log space, or pin too much of the
+      // buffer cache.  Once the running transaction has
+      // committed, make room by checkpointing.
+      if (log.outstanding == 0)
+        checkpoint_locked();
+      else
+        sleep(&log, &log.lock);
+    } else {
+      log.outstanding++;
+      release(&log.lock);
+      break;
+    }
   }
+}
 
-  if (log_header.size >= LOGSIZE-1) {
-    panic("log_write: log is full");
+// End a file system operation.  The last one out commits the
+// transaction for everybody.
+void end_op(void) {
+  int do_commit = 0;
+
+  acquire(&log.lock);
+  log.outstanding--;
+  if (log.committing)
+    panic("end_op: committing");
+  if (log.outstanding == 0) {
+    do_commit = 1;
+    log.committing = 1;
+  } else {
+    // begin_op() may be waiting for log space, and decrementing
+    // log.outstanding has decreased the amount reserved.
+    wakeup(&log);
+  }
+  release(&log.lock);
+
+  if (do_commit) {
+    // Call log_commit_tx without holding locks, since not allowed
+    // to sleep with locks.
+    log_commit_tx();
+    acquire(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
   }
-
-  // Write data block to log
-  struct buf* data_blk = bread(ROOTDEV, sb.logstart + log_header.size + 1);
-  memmove(&data_blk->data, &buf->data, BSIZE);
-  bwrite(data_blk);
-
-  // Update header and write it to disk
-  log_header.disk_loc[log_header.size] = buf->blockno;
-  log_header.size++;
-  memmove(&log_header_buf->data, &log_header, sizeof(struct logheader));
-  bwrite(log_header_buf);
-
-  brelse(data_blk);
-  brelse(log_header_buf);
 }
 
-// Completes the transaction and flushes it to disk
-static void log_commit_tx() {
-  struct buf* log_header_buf = bread(ROOTDEV, sb.logstart);
-  struct logheader log_header;
+// Checkpoint every committed transaction now, once running
+// operations have committed, leaving the log empty.
+void log_sync(void) {
+  acquire(&log.lock);
+  while (log.committing || log.outstanding > 0)
+    sleep(&log, &log.lock);
+  if (log.committed > 0)
+    checkpoint_locked();
+  release(&log.lock);
+}
 
-  memmove(&log_header, &log_header_buf->data, sizeof(struct logheader));
+// Record that buf, a locked home buffer, belongs to the running
+// transaction.  Use instead of bwrite().
+static void log_write(struct buf* buf) {
+  int i;
 
-  if (log_header.commit != LOG_INVALID) {
-    panic("log_commit_tx: commit flag is not invalid before commit");
+  acquire(&log.lock);
+  if (log.outstanding < 1)
+    panic("log_write: outside of an operation");
+  // Slots of committed transactions are on disk under a valid
+  // header and must not change, so only look at our own.
+  for (i = log.committed; i < log.size; i++) {
+    if (log.disk_loc[i] == buf->blockno)
+      break; // absorbed into the slot it already has
   }
-
-  if (log_header.size >= LOGSIZE) {
-    panic("log_commit_tx: log is full");
+  if (i == log.size) {
+    if (log.size >= log.nlog) {
+      panic("log_write: log is full");
+    }
+    log.disk_loc[log.size++] = buf->blockno;
   }
+  release(&log.lock);
 
-  // Update commit to VALID and write header to disk
-  log_header.commit = LOG_VALID;
-  memmove(&log_header_buf->data, &log_header, sizeof(struct logheader));
-  bwrite(log_header_buf);
-  brelse(log_header_buf);
-
-  // Update log header
-  log_header_buf = bread(ROOTDEV, sb.logstart);
-  memmove(&log_header, &log_header_buf->data, sizeof(struct logheader));
+  // Keep the home block in the cache until it is checkpointed.
+  buf->flags |= B_LOGGED;
+}
 
-  if (log_header.commit != LOG_VALID) {
-    panic("log_commit_tx: commit flag is not valid during commit");
+// Copy the home blocks of the running transaction into their
+// log slots and write the slots to disk, LOGBATCH at a time.
+static void write_log(void) {
+  struct buf* bufs[LOGBATCH];
+
+  for (int i = log.committed; i < log.size; i += LOGBATCH) {
+    int n = min(log.size - i, LOGBATCH);
+    for (int j = 0; j < n; j++) {
+      struct buf* data_buf = bread(ROOTDEV, log.disk_loc[i + j]);
+      // The slot is overwritten whole; do not read it first.
+      bufs[j] = bgetblk(ROOTDEV, sb.logstart + i + j + 1);
+      memmove(bufs[j]->data, data_buf->data, BSIZE);
+      brelse(data_buf);
+      bwrite(bufs[j]);
+      bflush_async(bufs[j]);
+    }
+    for (int j = 0; j < n; j++) {
+      bwait(bufs[j]);
+      brelse(bufs[j]);
+    }
   }
+}
 
-  if (log_header.size >= LOGSIZE) {
-    panic("log_commit_tx: log is full");
+// Is the block in log slot i logged again by a later slot?
+static int log_superseded(int i) {
+  for (int j = i + 1; j < log.committed; j++) {
+    if (log.disk_loc[j] == log.disk_loc[i])
+      return 1;
   }
+  return 0;
+}
 
-  // Transfer blocks
-  for (int i = 0; i < log_header.size; i++) {
-    struct buf* data_buf = bread(ROOTDEV, log_header.disk_loc[i]); // The actual disk block
-    struct buf* log_buf = bread(ROOTDEV, sb.logstart + i + 1); // The corresponding block in the log
+// Write the home blocks of the committed transactions to disk
+// and unpin them, LOGBATCH at a time.  Each block is written
+// once, from its last slot.
+static void install_trans(void) {
+  struct buf* bufs[LOGBATCH];
+  int i = 0;
+
+  while (i < log.committed) {
+    int n = 0;
+    for (; i < log.committed && n < LOGBATCH; i++) {
+      if (log_superseded(i))
+        continue;
+      bufs[n] = bread(ROOTDEV, log.disk_loc[i]);
+      bufs[n]->flags &= ~B_LOGGED;
+      bwrite(bufs[n]);
+      bflush_async(bufs[n]);
+      n++;
+    }
+    for (int j = 0; j < n; j++) {
+      bwait(bufs[j]);
+      brelse(bufs[j]);
+    }
+  }
+}
 
-    // Write to correct disk location
-    memmove(&data_buf->data, &log_buf->data, BSIZE);
-    bwrite(data_buf);
+// Commits the running transaction: writes its blocks to the log
+// and makes the commit record durable.  The home blocks are left
+// for log_checkpoint().  Only called by end_op(), with no
+// operation in progress.
+static void log_commit_tx() {
+  if (log.size == log.committed)
+    return;
 
-    brelse(data_buf);
-    brelse(log_buf);
-  }
+  // The logged blocks must be on disk before the commit record
+  write_log();
 
-  // Complete transaction by setting header flag to INVALID
-  log_header.commit = LOG_INVALID;
-  memmove(&log_header_buf->data, &log_header, sizeof(struct logheader));
+  // Write the header with commit VALID to disk.  It covers the
+  // transactions committed before this one, too.
+  struct buf* log_header_buf = bread(ROOTDEV, sb.logstart);
+  struct logheader* log_header = (struct logheader*)log_header_buf->data;
+  log_header->commit = LOG_VALID;
+  log_header->size = log.size;
+  memmove(log_header->disk_loc, log.disk_loc, log.size * sizeof(int));
   bwrite(log_header_buf);
-
+  bflush(log_header_buf);
   brelse(log_header_buf);
+
+  log.committed = log.size;
 }
 
-static void log_apply() {
-  cprintf("log_apply: start\n");
+// Installs the committed transactions at home and empties the
+// log.  Only called with log.committing set and no operation in
+// progress, so every slot in use belongs to a committed
+// transaction.
+static void log_checkpoint() {
+  if (log.committed == 0)
+    return;
 
-  struct buf* log_header_buf = bread(ROOTDEV, sb.logstart);
-  struct logheader log_header;
+  // The home blocks have to be on disk before the header is
+  // cleared below.
+  install_trans();
 
-  memmove(&log_header, &log_header_buf->data, sizeof(struct logheader));
+  // Complete the transactions by setting header flag to INVALID
+  struct buf* log_header_buf = bread(ROOTDEV, sb.logstart);
+  struct logheader* log_header = (struct logheader*)log_header_buf->data;
+  log_header->commit = LOG_INVALID;
+  log_header->size = 0;
+  bwrite(log_header_buf);
+  bflush(log_header_buf);
+  brelse(log_header_buf);
 
-  // If commited, apply the log to the disk
-  if (log_header.commit == LOG_VALID) {
-    // Transfer blocks
-    for (int i = 0; i < log_header.size; i++) {
-      struct buf* data_buff = bread(ROOTDEV, log_header.disk_loc[i]); // on disk
-      struct buf* log_buff = bread(ROOTDEV, sb.logstart + i + 1); // in log
+  log.committed = 0;
+  log.size = 0;
+}
 
-      // Write to correct disk location
-      memmove(&data_buff->data, &log_buff->data, BSIZE);
-      bwrite(data_buff);
+// Body of the checkpointer thread.  Every CHECKPOINT_INTERVAL ticks,
+// checkpoints whatever has committed if no operation is running,
+// so pinned buffers do not pile up in the cache between bursts.
+static void checkpointer(void) {
+  uint ticks0;
+
+  for (;;) {
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while (ticks - ticks0 < CHECKPOINT_INTERVAL)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    acquire(&log.lock);
+    if (log.committed > 0 && log.outstanding == 0 && !log.committing)
+      checkpoint_locked();
+    release(&log.lock);
+  }
+}
 
-      brelse(data_buff);
-      brelse(log_buff);
+// Read the committed log slots back into their home buffers and
+// pin them there, as if the transactions had just committed.
+// The reads go out LOGBATCH at a time; a slot whose block is
+// logged again later is skipped.
+static void log_load(void) {
+  struct buf* bufs[LOGBATCH];
+  int slot[LOGBATCH];
+  int i = 0;
+
+  while (i < log.committed) {
+    int n = 0;
+    for (; i < log.committed && n < LOGBATCH; i++) {
+      if (log_superseded(i))
+        continue;
+      slot[n] = i;
+      bufs[n++] = bread_async(ROOTDEV, sb.logstart + i + 1);
+    }
+    for (int j = 0; j < n; j++) {
+      bwait(bufs[j]);
+      struct buf* data_buf = bgetblk(ROOTDEV, log.disk_loc[slot[j]]);
+      memmove(data_buf->data, bufs[j]->data, BSIZE);
+      data_buf->flags |= B_LOGGED;
+      brelse(data_buf);
+      brelse(bufs[j]);
     }
   }
-  cprintf("log_apply: commit=%d\n", log_header.commit);
+}
 
-  log_header.commit = LOG_INVALID;
-  log_header.size = 0;
+// Recover after a crash: install whatever the log holds under a
+// valid commit record.  Returns the number of log slots replayed.
+static int log_apply() {
+  cprintf("log_apply: start\n");
 
-  memmove(&log_header_buf->data, &log_header, sizeof(struct logheader));
-  bwrite(log_header_buf);
+  struct buf* log_header_buf = bread(ROOTDEV, sb.logstart);
+  struct logheader* log_header = (struct logheader*)log_header_buf->data;
+  int commit = log_header->commit;
+  int size = log_header->size;
+
+  if (commit == LOG_VALID) {
+    if (size < 0 || size > sb.nlog)
+      panic("log_apply: bad log header");
+    if (size > log.nlog)
+      panic("log_apply: log too big for the buffer cache");
+    memmove(log.disk_loc, log_header->disk_loc, size * sizeof(int));
+  }
   brelse(log_header_buf);
+  cprintf("log_apply: commit=%d\n", commit);
+
+  // If commited, apply the log to the disk.  log_checkpoint()
+  // also marks the header INVALID.
+  if (commit != LOG_VALID)
+    return 0;
+  log.size = log.committed = size;
+  log_load();
+  log_checkpoint();
+  return size;
 }
 
 // Read the super block.
@@ -167,71 +375,932 @@ void readsb(int dev, struct superblock *sb) {
   brelse(bp);
 }
 
-// mark [start, end] bit in bp->data to 1 if used is true, else 0
-static void bmark(struct buf *bp, uint start, uint end, bool used)
+// Bits [b % 64, b % 64 + k) of a word; k must not reach past it.
+static uint64_t bitmask(uint b, uint k)
+{
+  return (k == 64 ? ~(uint64_t)0 : ((uint64_t)1 << k) - 1) << (b % 64);
+}
+
+// Set (used) or clear bits [b, b + n) of the bitmap in words,
+// a 64-bit word at a time.  Bit b % 64 of words[b / 64] stands
+// for block b, which on a little-endian machine matches the byte
+// layout of the on-disk bitmap.
+static void markbits(uint64_t *words, uint b, uint n, bool used)
 {
-  int m, bi;
-  for (bi = start; bi <= end; bi++) {
-    m = 1 << (bi % 8);
+  uint64_t m;
+  uint k;
+
+  for (; n > 0; b += k, n -= k) {
+    k = min(n, 64 - b % 64);
+    m = bitmask(b, k);
     if (used) {
-      bp->data[bi/8] |= m;  // Mark block in use.
+      words[b / 64] |= m;  // Mark blocks in use.
     } else {
-      if((bp->data[bi/8] & m) == 0)
+      if ((words[b / 64] & m) != m)
         panic("freeing free block");
-      bp->data[bi/8] &= ~m; // Mark block as free.
+      words[b / 64] &= ~m; // Mark blocks as free.
     }
   }
-  bp->flags |= B_DIRTY; // mark our update
+}
+
+// mark [start, end] bit in bp->data to 1 if used is true, else 0
+static void bmark(struct buf *bp, uint start, uint end, bool used)
+{
+  markbits((uint64_t *)bp->data, start, end - start + 1, used);
   log_write(bp);
 }
 
+// Mark blocks [b, b + n) in the on-disk bitmap, one bitmap block
+// at a time.
+static void bmarkrange(uint dev, uint b, uint n, bool used)
+{
+  struct buf *bp;
+  uint m;
+
+  for (; n > 0; b += m, n -= m) {
+    m = min(n, BPB - b % BPB);
+    bp = bread(dev, BBLOCK(b, sb));
+    bmark(bp, b % BPB, b % BPB + m - 1, used);
+    brelse(bp);
+  }
+}
+
 // Blocks.
+//
+// The bitmap on disk, written through the log, is the durable
+// record of which blocks are free.  The allocator works from an
+// in-memory copy built at mount, with a summary tree on top: each
+// node of a complete binary tree over the bitmap's 64-bit words
+// records the longest free run below it, and the free runs at
+// its left and right ends.  Finding the leftmost run of n free
+// blocks walks down one path of the tree, so it costs O(log n)
+// however full the disk is, and a run may cross word and bitmap
+// block boundaries.
+
+#define FREEMAPLEAVES 1024 // words in the free map, a power of two
+static_assert(FREEMAPLEAVES * 64 >= FSSIZE, "FREEMAPLEAVES too small");
+
+struct freerun {
+  uint first; // free blocks at the start (lowest numbers)
+  uint last;  // free blocks at the end
+  uint max;   // longest free run
+};
+
+static struct {
+  struct spinlock lock;
+  uint nleaves;                     // words in use, a power of two
+  uint64_t map[FREEMAPLEAVES];      // bit set = block in use
+  struct freerun run[2 * FREEMAPLEAVES]; // node i has children 2i, 2i+1
+} freemap;
+
+// Summarize the free runs in map word i.
+static void freemap_leaf(uint i) {
+  uint64_t w = freemap.map[i];
+  uint64_t x = ~w; // free blocks
+  struct freerun *r = &freemap.run[freemap.nleaves + i];
+  uint k;
+
+  r->first = w ? __builtin_ctzll(w) : 64;
+  r->last = w ? __builtin_clzll(w) : 64;
+
+  // Hop from one free run to the next.  x is shifted down so
+  // that its lowest bit starts a run.
+  r->max = 0;
+  while (x) {
+    x >>= __builtin_ctzll(x);
+    k = ~x ? __builtin_ctzll(~x) : 64;
+    r->max = max(r->max, k);
+    x = k == 64 ? 0 : x >> k;
+  }
+}
+
+// Recompute node i from its children, which cover len blocks each.
+static void freemap_pull(uint i, uint len) {
+  struct freerun *l = &freemap.run[2 * i];
+  struct freerun *r = &freemap.run[2 * i + 1];
+  struct freerun *p = &freemap.run[i];
+
+  p->first = l->first == len ? len + r->first : l->first;
+  p->last = r->last == len ? len + l->last : r->last;
+  p->max = max(max(l->max, r->max), l->last + r->first);
+}
+
+// Recompute the summaries of words lo..hi and their ancestors.
+static void freemap_update(uint lo, uint hi) {
+  uint i, len;
+
+  for (i = lo; i <= hi; i++)
+    freemap_leaf(i);
+  lo += freemap.nleaves;
+  hi += freemap.nleaves;
+  for (len = 64; lo > 1; len *= 2) {
+    lo /= 2;
+    hi /= 2;
+    for (i = lo; i <= hi; i++)
+      freemap_pull(i, len);
+  }
+}
+
+// Mark blocks [b, b + n) used or free in the free map.
+// Caller must hold freemap.lock.
+static void freemap_set(uint b, uint n, bool used) {
+  markbits(freemap.map, b, n, used);
+  freemap_update(b / 64, (b + n - 1) / 64);
+}
+
+// Find the leftmost run of n free blocks below node i, which
+// starts at block base and covers len blocks.  Returns its first
+// block, or -1 if there is none.  Caller must hold freemap.lock.
+static int freemap_find(uint i, uint base, uint len, uint n) {
+  uint64_t y;
+  uint s, t;
+
+  if (freemap.run[i].max < n)
+    return -1;
+
+  if (i >= freemap.nleaves) {
+    // Fold the free bits onto themselves until bit k is set only
+    // if blocks k .. k + s - 1 are all free, for s = n.
+    y = ~freemap.map[i - freemap.nleaves];
+    for (s = 1; s < n; s += t) {
+      t = min(s, n - s);
+      y &= y >> t;
+    }
+    if (y == 0)
+      panic("freemap_find");
+    return base + __builtin_ctzll(y);
+  }
+
+  len /= 2;
+  if (freemap.run[2 * i].max >= n)
+    return freemap_find(2 * i, base, len, n);
+  if (freemap.run[2 * i].last + freemap.run[2 * i + 1].first >= n)
+    return base + len - freemap.run[2 * i].last;
+  return freemap_find(2 * i + 1, base + len, len, n);
+}
+
+// Size the free map for sb.size blocks and mark everything in it
+// free except the blocks past the end of the file system.
+static void freemap_reset(void) {
+  for (freemap.nleaves = 1; freemap.nleaves * 64 < sb.size;)
+    freemap.nleaves *= 2;
+  if (freemap.nleaves > FREEMAPLEAVES)
+    panic("freemap_init: file system too big");
+
+  memset(freemap.map, 0, sizeof(freemap.map));
+  markbits(freemap.map, sb.size, freemap.nleaves * 64 - sb.size, true);
+}
+
+// Build the free map from the on-disk bitmap.
+static void freemap_init(uint dev) {
+  struct buf *bp;
+  uint b;
+
+  initlock(&freemap.lock, "freemap");
+  freemap_reset();
+  for (b = 0; b < sb.size; b += BPB) {
+    bp = bread(dev, BBLOCK(b, sb));
+    memmove((char *)freemap.map + b / 8, bp->data,
+            min((uint)BSIZE, (sb.size - b + 7) / 8));
+    brelse(bp);
+  }
+  markbits(freemap.map, sb.size, freemap.nleaves * 64 - sb.size, true);
+
+  freemap_update(0, freemap.nleaves - 1);
+}
+
+#ifdef FREEMAP_BENCH
+// Microbenchmark of the block allocator's bitmap work, run at
+// mount in kernels built with FREEMAP_BENCH=1.  Works on the free
+// map before freemap_init() fills it in, so the disk is untouched.
+
+#define BENCHRUNS 1000
+
+// Allocate BENCHRUNS runs of 1 .. maxrun blocks (fewer if the map
+// fills up), free them all, and print the cycles per operation.
+static void freemap_bench1(char *what, uint maxrun) {
+  static uint start[BENCHRUNS], len[BENCHRUNS];
+  uint64_t t0, talloc, tfree;
+  int b, i, n;
+
+  t0 = rdtsc();
+  for (n = 0; n < BENCHRUNS; n++) {
+    len[n] = 1 + n % maxrun;
+    if ((b = freemap_find(1, 0, freemap.nleaves * 64, len[n])) < 0)
+      break;
+    start[n] = b;
+    freemap_set(b, len[n], true);
+  }
+  talloc = rdtsc() - t0;
+
+  t0 = rdtsc();
+  for (i = 0; i < n; i++)
+    freemap_set(start[i], len[i], false);
+  tfree = rdtsc() - t0;
+
+  if (n > 0)
+    cprintf("freemap bench %s: %d runs, %ld cycles/alloc, %ld cycles/free\n",
+            what, n, talloc / n, tfree / n);
+}
+
+static void freemap_bench(void) {
+  uint b, seed = 1;
+
+  // An empty disk.
+  freemap_reset();
+  freemap_update(0, freemap.nleaves - 1);
+  freemap_bench1("empty", 8);
+
+  // A fragmented one: about half the blocks, picked at random,
+  // in use, so most free runs are short.
+  freemap_reset();
+  for (b = 0; b < sb.size; b++) {
+    seed = seed * 1103515245 + 12345;
+    if (seed & 0x10000)
+      markbits(freemap.map, b, 1, true);
+  }
+  freemap_update(0, freemap.nleaves - 1);
+  freemap_bench1("fragmented", 4);
+}
+#endif
 
 // Allocate n disk blocks, no promise on content of allocated disk blocks
-// Returns the beginning block number of a consecutive chunk of n blocks
+// Returns the beginning block number of a consecutive chunk of n blocks,
+// or 0 if there is no such chunk.
 static uint balloc(uint dev, uint n)
 {
-  int b, bi, m;
-  struct buf *bp;
+  int b;
 
-  bp = 0;
-  for (b = 0; b < sb.size; b += BPB) {
-    bp = bread(dev, BBLOCK(b, sb)); // look through each bitmap sector
-
-    uint sz = 0;
-    uint i = 0;
-    for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-      m = 1 << (bi % 8);
-      if ((bp->data[bi/8] & m) == 0) {  // Is block free?
-        sz++;
-        if (sz == 1) // reset starting blk
-          i = bi;
-        if (sz == n) { // found n blks
-          bmark(bp, i, bi, true); // mark data block as used
-          brelse(bp);
-          return b+i;
-        }
-      } else { // reset search
-        sz = 0;
-        i =0;
-      }
+  acquire(&freemap.lock);
+  b = freemap_find(1, 0, freemap.nleaves * 64, n);
+  if (b < 0) {
+    release(&freemap.lock);
+    return 0;
+  }
+  freemap_set(b, n, true);
+  release(&freemap.lock);
+
+  bmarkrange(dev, b, n, true);
+  return b;
+}
+
+// Allocate the n disk blocks starting at b, to grow an extent that
+// ends there in place.  Returns 0, or -1 if any of them is in use.
+static int bextend(uint dev, uint b, uint n)
+{
+  uint i, k;
+
+  if (b + n > sb.size)
+    return -1;
+
+  acquire(&freemap.lock);
+  for (i = b; i < b + n; i += k) {
+    k = min(b + n - i, 64 - i % 64);
+    if (freemap.map[i / 64] & bitmask(i, k)) {
+      release(&freemap.lock);
+      return -1;
     }
-    brelse(bp);
   }
-  panic("balloc: can't allocate contiguous blocks");
+  freemap_set(b, n, true);
+  release(&freemap.lock);
+
+  bmarkrange(dev, b, n, true);
+  return 0;
 }
 
 // Free n disk blocks starting from b
 static void bfree(int dev, uint b, uint n)
 {
+  assertm(n >= 1, "freeing less than 1 block");
+
+  // Clear the bits on disk first: once the free map has them,
+  // another operation may allocate and mark the blocks again.
+  bmarkrange(dev, b, n, false);
+
+  acquire(&freemap.lock);
+  freemap_set(b, n, false);
+  release(&freemap.lock);
+}
+
+
+// Extent tree.
+//
+// See fs.h for the format.  A hole is an extent with startblkno 0
+// (block 0 never belongs to a file): its blocks read as zeros and
+// take no space on disk.  Files grow at the end and shrink from
+// the end (itrim), so most changes to the tree are to its last
+// extent.  The exception is a write into a hole, which splits the
+// hole's extent (see ifill).  Lock order is index block, then
+// leaf, then bitmap.
+
+// Index of the last of the n entries at a, stride bytes apart,
+// whose leading lblk field is at most lbn.  The first one must be.
+static uint lblksearch(void *a, uint n, uint stride, uint lbn) {
+  uint lo, hi, mid;
+
+  for (lo = 0, hi = n - 1; lo < hi;) {
+    mid = (lo + hi + 1) / 2;
+    if (*(uint *)((char *)a + mid * stride) <= lbn)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Recompute where each inline extent of ip starts.
+static void ilblks(struct inode *ip) {
+  uint i, lbn = 0;
+
+  for (i = 0; i < EXTENTS && ip->data[i].nblocks != 0; i++) {
+    ip->lblk[i] = lbn;
+    lbn += ip->data[i].nblocks;
+  }
+  ip->nextents = i;
+}
+
+// Fill in the derived fields of ip from its extents: where each
+// inline extent starts, and how many blocks the file has.
+static void iloadext(struct inode *ip) {
+  struct buf *ibp, *lbp;
+  struct extentindex *idx;
+  struct extentleaf *leaf;
+
+  ilblks(ip);
+  ip->nblocks = 0;
+  if (ip->nextents > 0)
+    ip->nblocks = ip->lblk[ip->nextents - 1] + ip->data[ip->nextents - 1].nblocks;
+
+  if (ip->indirect) {
+    ibp = bread(ip->dev, ip->indirect);
+    idx = (struct extentindex *)ibp->data;
+    lbp = bread(ip->dev, idx->leaf[idx->n - 1].blkno);
+    leaf = (struct extentleaf *)lbp->data;
+    ip->nblocks = leaf->e[leaf->n - 1].lblk + leaf->e[leaf->n - 1].e.nblocks;
+    brelse(lbp);
+    brelse(ibp);
+  }
+}
+
+// Is file block lbn of ip mapped by an inline extent?
+static int isinline(struct inode *ip, uint lbn) {
+  return !ip->indirect ||
+         lbn < ip->lblk[EXTENTS - 1] + ip->data[EXTENTS - 1].nblocks;
+}
+
+// Set *ie to the extent of ip holding file block lbn.
+// Caller must hold ip->lock.
+static void ifind(struct inode *ip, uint lbn, struct iextent *ie) {
+  struct buf *ibp, *lbp;
+  struct extentindex *idx;
+  struct extentleaf *leaf;
+  uint i;
+
+  if (lbn >= ip->nblocks)
+    panic("ifind: past end of file");
+
+  if (isinline(ip, lbn)) {
+    i = lblksearch(ip->lblk, ip->nextents, sizeof(uint), lbn);
+    ie->lblk = ip->lblk[i];
+    ie->e = ip->data[i];
+    return;
+  }
+
+  ibp = bread(ip->dev, ip->indirect);
+  idx = (struct extentindex *)ibp->data;
+  i = lblksearch(idx->leaf, idx->n, sizeof(idx->leaf[0]), lbn);
+  lbp = bread(ip->dev, idx->leaf[i].blkno);
+  brelse(ibp);
+
+  leaf = (struct extentleaf *)lbp->data;
+  i = lblksearch(leaf->e, leaf->n, sizeof(leaf->e[0]), lbn);
+  *ie = leaf->e[i];
+  brelse(lbp);
+}
+
+// Return the disk block holding file block lbn of ip, 0 if it is
+// in a hole, and set *run (if not null) to the number of blocks
+// from there to the end of its extent.  Caller must hold ip->lock.
+static uint ibmap(struct inode *ip, uint lbn, uint *run) {
+  struct iextent ie;
+
+  ifind(ip, lbn, &ie);
+  if (run)
+    *run = ie.e.nblocks - (lbn - ie.lblk);
+  if (ie.e.startblkno == 0)
+    return 0;
+  return ie.e.startblkno + (lbn - ie.lblk);
+}
+
+// Return a zeroed, locked buffer for the newly allocated block b.
+static struct buf *bzeroed(uint dev, uint b) {
   struct buf *bp;
 
-  assertm(n >= 1, "freeing less than 1 block");
-  assertm(BBLOCK(b, sb) == BBLOCK(b+n-1, sb), "returned blocks live in different bitmap sectors");
+  bp = bgetblk(dev, b);
+  memset(bp->data, 0, BSIZE);
+  return bp;
+}
 
-  bp = bread(dev, BBLOCK(b, sb));
-  bmark(bp, b % BPB, (b+n-1) % BPB, false);
-  brelse(bp);
+// Return ip's index block, locked, allocating it if ip has none.
+static struct buf *iindex(struct inode *ip) {
+  uint b;
+
+  if (ip->indirect)
+    return bread(ip->dev, ip->indirect);
+  if ((b = balloc(ip->dev, 1)) == 0)
+    panic("iindex: out of blocks");
+  ip->indirect = b;
+  return bzeroed(ip->dev, b);
+}
+
+// Replace del entries at position j of leaf with the k at v.
+static void leafput(struct extentleaf *leaf, uint j, uint del,
+                    struct iextent *v, uint k) {
+  memmove(leaf->e + j + k, leaf->e + j + del,
+          (leaf->n - j - del) * sizeof(leaf->e[0]));
+  memmove(leaf->e + j, v, k * sizeof(v[0]));
+  leaf->n += k - del;
+}
+
+// Replace del (0 or 1) entries at position j of leaf l of the
+// index in ibp with the k at v, and log the blocks changed.  If
+// they do not fit, the leaf is split in two, except when adding
+// to the end of the last leaf: then the new entries start a leaf
+// of their own, so a file that only grows at the end keeps its
+// leaves full.
+static void leafsplice(struct inode *ip, struct buf *ibp, uint l, uint j,
+                       uint del, struct iextent *v, uint k) {
+  struct extentindex *idx = (struct extentindex *)ibp->data;
+  struct extentleaf *leaf, *right;
+  struct buf *lbp, *rbp;
+  uint b, h;
+
+  if (idx->n == 0) {
+    // A new index: give it its first leaf.
+    if ((b = balloc(ip->dev, 1)) == 0)
+      panic("leafsplice: out of blocks");
+    lbp = bzeroed(ip->dev, b);
+    idx->leaf[0].blkno = b;
+    idx->n = 1;
+  } else {
+    lbp = bread(ip->dev, idx->leaf[l].blkno);
+  }
+  leaf = (struct extentleaf *)lbp->data;
+
+  if (leaf->n - del + k <= NLEAFEXTENTS) {
+    leafput(leaf, j, del, v, k);
+    idx->leaf[l].lblk = leaf->e[0].lblk;
+    log_write(lbp);
+    brelse(lbp);
+    log_write(ibp);
+    return;
+  }
+
+  if (idx->n == NINDEXLEAVES)
+    panic("leafsplice: file too fragmented");
+  if ((b = balloc(ip->dev, 1)) == 0)
+    panic("leafsplice: out of blocks");
+  rbp = bzeroed(ip->dev, b);
+  right = (struct extentleaf *)rbp->data;
+
+  h = (l == idx->n - 1 && j == leaf->n) ? leaf->n : leaf->n / 2;
+  right->n = leaf->n - h;
+  memmove(right->e, leaf->e + h, right->n * sizeof(leaf->e[0]));
+  leaf->n = h;
+  if (j < h)
+    leafput(leaf, j, del, v, k);
+  else
+    leafput(right, j - h, del, v, k);
+
+  memmove(idx->leaf + l + 2, idx->leaf + l + 1,
+          (idx->n - l - 1) * sizeof(idx->leaf[0]));
+  idx->n++;
+  idx->leaf[l].lblk = leaf->e[0].lblk;
+  idx->leaf[l + 1].lblk = right->e[0].lblk;
+  idx->leaf[l + 1].blkno = b;
+
+  log_write(lbp);
+  brelse(lbp);
+  log_write(rbp);
+  brelse(rbp);
+  log_write(ibp);
+}
+
+// Inline extent x of ip as it will be once extent i is replaced
+// by the k at v.
+static struct iextent inlineext(struct inode *ip, uint i,
+                                struct iextent *v, uint k, uint x) {
+  struct iextent ie;
+
+  if (x >= i && x < i + k)
+    return v[x - i];
+  if (x > i)
+    x -= k - 1;
+  ie.lblk = ip->lblk[x];
+  ie.e = ip->data[x];
+  return ie;
+}
+
+// Replace the extent of ip holding file block lbn with the k (1
+// to 3) extents at v, which must cover the same blocks.  Extents
+// pushed out of the dinode go to the front of the first leaf.
+// The inline extents are edited in place, with no copy on the
+// stack: this also runs for the inodefile under update_dinode.
+// Caller must hold ip->lock and write the dinode afterwards.
+static void iextset(struct inode *ip, uint lbn, struct iextent *v, uint k) {
+  struct iextent spill[2];
+  struct buf *ibp, *lbp;
+  struct extentindex *idx;
+  struct extentleaf *leaf;
+  uint i, j, n;
+
+  if (isinline(ip, lbn)) {
+    i = lblksearch(ip->lblk, ip->nextents, sizeof(uint), lbn);
+    n = ip->nextents + k - 1;
+
+    if (n > EXTENTS) {
+      for (j = EXTENTS; j < n; j++)
+        spill[j - EXTENTS] = inlineext(ip, i, v, k, j);
+      ibp = iindex(ip);
+      leafsplice(ip, ibp, 0, 0, 0, spill, n - EXTENTS);
+      brelse(ibp);
+      n = EXTENTS;
+    }
+
+    // From the end, so every extent moves before it is overwritten.
+    for (j = n; j > i; j--)
+      ip->data[j - 1] = inlineext(ip, i, v, k, j - 1).e;
+    memset(ip->data + n, 0, (EXTENTS - n) * sizeof(ip->data[0]));
+    ilblks(ip);
+    return;
+  }
+
+  ibp = bread(ip->dev, ip->indirect);
+  idx = (struct extentindex *)ibp->data;
+  i = lblksearch(idx->leaf, idx->n, sizeof(idx->leaf[0]), lbn);
+  lbp = bread(ip->dev, idx->leaf[i].blkno);
+  leaf = (struct extentleaf *)lbp->data;
+  j = lblksearch(leaf->e, leaf->n, sizeof(leaf->e[0]), lbn);
+  brelse(lbp);
+  leafsplice(ip, ibp, i, j, 1, v, k);
+  brelse(ibp);
+}
+
+// Add n blocks to the end of ip: the ones at startblkno, or a hole
+// if startblkno is 0.  The last extent grows if they continue it.
+// Caller must hold ip->lock and write the dinode afterwards.
+static void iaddblocks(struct inode *ip, uint startblkno, uint n) {
+  struct buf *ibp, *lbp;
+  struct extentindex *idx;
+  struct extentleaf *leaf;
+  struct iextent last, ie;
+  uint l, j;
+
+  if (ip->nblocks > 0) {
+    ifind(ip, ip->nblocks - 1, &last);
+    if (startblkno == 0 ? last.e.startblkno == 0
+                        : last.e.startblkno != 0 &&
+                              last.e.startblkno + last.e.nblocks == startblkno) {
+      last.e.nblocks += n;
+      iextset(ip, last.lblk, &last, 1);
+      ip->nblocks += n;
+      return;
+    }
+  }
+
+  if (!ip->indirect && ip->nextents < EXTENTS) {
+    ip->data[ip->nextents].startblkno = startblkno;
+    ip->data[ip->nextents].nblocks = n;
+    ip->lblk[ip->nextents] = ip->nblocks;
+    ip->nextents++;
+  } else {
+    ie.lblk = ip->nblocks;
+    ie.e.startblkno = startblkno;
+    ie.e.nblocks = n;
+    ibp = iindex(ip);
+    idx = (struct extentindex *)ibp->data;
+    l = j = 0;
+    if (idx->n > 0) {
+      l = idx->n - 1;
+      lbp = bread(ip->dev, idx->leaf[l].blkno);
+      leaf = (struct extentleaf *)lbp->data;
+      j = leaf->n;
+      brelse(lbp);
+    }
+    leafsplice(ip, ibp, l, j, 0, &ie, 1);
+    brelse(ibp);
+  }
+  ip->nblocks += n;
+}
+
+// Give ip at least n more blocks.  The last extent grows in place
+// if the blocks after it are free.  A regular file also
+// preallocates: it grows by at least as many blocks as it already
+// has, up to MAXPREALLOC, so one built from many small appends
+// ends up in few extents.  Closing the file trims what was not
+// used (see itrim).  The inodefile is never opened, so nothing
+// would trim it, and it does not preallocate.  Caller must hold
+// ip->lock and write the dinode afterwards.
+static void iextend(struct inode *ip, uint n) {
+  uint want = n, end = 0, b = 0;
+
+  if (ip->type == T_FILE && ip->inum != INODEFILEINO)
+    want = max(n, min(ip->nblocks, (uint)MAXPREALLOC));
+
+  if (ip->nblocks > 0 && (end = ibmap(ip, ip->nblocks - 1, 0)) != 0) {
+    end++;
+    if (bextend(ip->dev, end, want) == 0) {
+      b = end;
+    } else if (want > n && bextend(ip->dev, end, n) == 0) {
+      b = end;
+      want = n;
+    }
+  }
+  if (b == 0 && (b = balloc(ip->dev, want)) == 0 && want > n) {
+    want = n;
+    b = balloc(ip->dev, want);
+  }
+  if (b == 0)
+    panic("balloc: can't allocate contiguous blocks");
+
+  iaddblocks(ip, b, want);
+}
+
+// Allocate the n blocks of ip from lbn on, which are all in one
+// hole, and return the first.  If lbn starts the hole and the
+// blocks after the extent before it are free, that extent grows
+// over them.  Caller must hold ip->lock and write the dinode
+// afterwards.
+static uint ifill(struct inode *ip, uint lbn, uint n) {
+  struct iextent hole, prev, v[3];
+  uint b = 0, k = 0;
+
+  ifind(ip, lbn, &hole);
+  if (lbn == hole.lblk && lbn > 0) {
+    ifind(ip, lbn - 1, &prev);
+    if (prev.e.startblkno != 0 &&
+        bextend(ip->dev, prev.e.startblkno + prev.e.nblocks, n) == 0) {
+      b = prev.e.startblkno + prev.e.nblocks;
+      if (n < hole.e.nblocks) {
+        // Shrink the hole first, so the lookup for prev still
+        // finds it.
+        v[0].lblk = lbn + n;
+        v[0].e.startblkno = 0;
+        v[0].e.nblocks = hole.e.nblocks - n;
+        iextset(ip, lbn, v, 1);
+        prev.e.nblocks += n;
+        iextset(ip, prev.lblk, &prev, 1);
+        return b;
+      }
+    }
+  }
+  if (b == 0 && (b = balloc(ip->dev, n)) == 0)
+    panic("balloc: can't allocate contiguous blocks");
+
+  if (lbn > hole.lblk) {
+    v[k].lblk = hole.lblk;
+    v[k].e.startblkno = 0;
+    v[k++].e.nblocks = lbn - hole.lblk;
+  }
+  v[k].lblk = lbn;
+  v[k].e.startblkno = b;
+  v[k++].e.nblocks = n;
+  if (lbn + n < hole.lblk + hole.e.nblocks) {
+    v[k].lblk = lbn + n;
+    v[k].e.startblkno = 0;
+    v[k++].e.nblocks = hole.lblk + hole.e.nblocks - (lbn + n);
+  }
+  iextset(ip, lbn, v, k);
+  return b;
+}
+
+// Free ip's blocks from file block keep on, last extent first.
+// Caller must hold ip->lock and write the dinode afterwards.
+static void itruncblocks(struct inode *ip, uint keep) {
+  struct buf *ibp, *lbp;
+  struct extentindex *idx;
+  struct extentleaf *leaf;
+  struct extent *e;
+  uint cut;
+
+  while (ip->nblocks > keep) {
+    if (!ip->indirect) {
+      e = &ip->data[ip->nextents - 1];
+      cut = min(e->nblocks, ip->nblocks - keep);
+      if (e->startblkno != 0)
+        bfree(ip->dev, e->startblkno + e->nblocks - cut, cut);
+      e->nblocks -= cut;
+      if (e->nblocks == 0) {
+        e->startblkno = 0;
+        ip->nextents--;
+      }
+      ip->nblocks -= cut;
+      continue;
+    }
+
+    ibp = bread(ip->dev, ip->indirect);
+    idx = (struct extentindex *)ibp->data;
+    lbp = bread(ip->dev, idx->leaf[idx->n - 1].blkno);
+    leaf = (struct extentleaf *)lbp->data;
+    e = &leaf->e[leaf->n - 1].e;
+    cut = min(e->nblocks, ip->nblocks - keep);
+    if (e->startblkno != 0)
+      bfree(ip->dev, e->startblkno + e->nblocks - cut, cut);
+    e->nblocks -= cut;
+    ip->nblocks -= cut;
+    if (e->nblocks == 0)
+      leaf->n--;
+
+    if (leaf->n > 0) {
+      log_write(lbp);
+      brelse(lbp);
+      brelse(ibp);
+      continue;
+    }
+    brelse(lbp);
+    bfree(ip->dev, idx->leaf[idx->n - 1].blkno, 1);
+    idx->n--;
+    if (idx->n > 0) {
+      log_write(ibp);
+      brelse(ibp);
+    } else {
+      brelse(ibp);
+      bfree(ip->dev, ip->indirect, 1);
+      ip->indirect = 0;
+    }
+  }
+}
+
+// Free every block of the file described by *dip, extent tree
+// blocks included.
+static void dfree(uint dev, struct dinode *dip) {
+  struct buf *ibp, *lbp;
+  struct extentindex *idx;
+  struct extentleaf *leaf;
+  uint i, j;
+
+  for (i = 0; i < EXTENTS && dip->data[i].nblocks != 0; i++)
+    if (dip->data[i].startblkno != 0)
+      bfree(dev, dip->data[i].startblkno, dip->data[i].nblocks);
+
+  if (dip->indirect) {
+    ibp = bread(dev, dip->indirect);
+    idx = (struct extentindex *)ibp->data;
+    for (i = 0; i < idx->n; i++) {
+      lbp = bread(dev, idx->leaf[i].blkno);
+      leaf = (struct extentleaf *)lbp->data;
+      for (j = 0; j < leaf->n; j++)
+        if (leaf->e[j].e.startblkno != 0)
+          bfree(dev, leaf->e[j].e.startblkno, leaf->e[j].e.nblocks);
+      brelse(lbp);
+      bfree(dev, idx->leaf[i].blkno, 1);
+    }
+    brelse(ibp);
+    bfree(dev, dip->indirect, 1);
+  }
+}
+
+
+// Directory entry cache.
+//
+// dirlookup remembers what it found for each (directory, name)
+// it looks up, including that there was no such entry, so that
+// resolving a hot path reads no directory blocks.  Only icreate
+// and iunlink change directories, and they update the cache after
+// writing the entry; entries that move when a directory's index
+// grows are updated as they move.  dirlookup fills it in while holding the
+// directory's lock, so what it enters cannot be older than a
+// change made while it scanned.
+
+int num_dcache_hits = 0;   // dirlookup answered from the dcache
+int num_dcache_misses = 0; // dirlookup read the directory
+
+#define NDBUCKET 127 // hash buckets, prime
+
+struct dentry {
+  uint dev;          // 0 if the entry is unused
+  uint dir;          // inum of the directory
+  char name[DIRSIZ];
+  uint inum;         // inum the name maps to, 0 if none
+  uint off;          // byte offset of the entry in the directory
+  struct dentry *prev; // LRU list
+  struct dentry *next;
+  struct dentry *hnext; // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCACHE];
+
+  // Hash chains of the entries in use, through hnext.
+  struct dentry *hash[NDBUCKET];
+
+  // All entries, through prev/next.  lru.next is most recently used.
+  struct dentry lru;
+} dcache;
+
+static uint dhash(uint dev, uint dir, char *name) {
+  uint h = (dev << 24) ^ dir;
+  int i;
+
+  for (i = 0; i < DIRSIZ && name[i] != 0; i++)
+    h = h * 31 + name[i];
+  return h % NDBUCKET;
+}
+
+static void dinit(void) {
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.prev = &dcache.lru;
+  dcache.lru.next = &dcache.lru;
+  for (d = dcache.dentry; d < dcache.dentry + NDCACHE; d++) {
+    d->next = dcache.lru.next;
+    d->prev = &dcache.lru;
+    dcache.lru.next->prev = d;
+    dcache.lru.next = d;
+  }
+}
+
+// Move d to the most recently used end of the LRU list.
+// Caller must hold dcache.lock.
+static void dtouch(struct dentry *d) {
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = dcache.lru.next;
+  d->prev = &dcache.lru;
+  dcache.lru.next->prev = d;
+  dcache.lru.next = d;
+}
+
+// Find the entry for name in directory dir, or 0.
+// Caller must hold dcache.lock.
+static struct dentry *dfind(uint dev, uint dir, char *name) {
+  struct dentry *d;
+
+  for (d = dcache.hash[dhash(dev, dir, name)]; d != 0; d = d->hnext)
+    if (d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Look name up in directory dir.  Returns 1 and sets *inum (0 if
+// there is no such entry) and *off if the answer is cached.
+static int dcache_lookup(uint dev, uint dir, char *name, uint *inum, uint *off) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = dfind(dev, dir, name)) == 0) {
+    release(&dcache.lock);
+    return 0;
+  }
+  dtouch(d);
+  *inum = d->inum;
+  *off = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dir is inum (0 if there is no
+// such entry), at byte offset off.
+static void dcache_enter(uint dev, uint dir, char *name, uint inum, uint off) {
+  struct dentry *d, **pp;
+
+  acquire(&dcache.lock);
+  if ((d = dfind(dev, dir, name)) == 0) {
+    // Recycle the least recently used entry.
+    d = dcache.lru.prev;
+    if (d->dev != 0) {
+      for (pp = &dcache.hash[dhash(d->dev, d->dir, d->name)]; *pp != d;
+           pp = &(*pp)->hnext)
+        ;
+      *pp = d->hnext;
+    }
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+    d->hnext = dcache.hash[dhash(dev, dir, name)];
+    dcache.hash[dhash(dev, dir, name)] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// Note that the entry for name in directory dir moved to byte
+// offset off, if the cache has it.
+static void dcache_move(uint dev, uint dir, char *name, uint off) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = dfind(dev, dir, name)) != 0 && d->inum != 0)
+    d->off = off;
+  release(&dcache.lock);
+}
+
+struct inode *rootlookup(char *name) {
+  return dirlookup(namei("/"), name, 0);
 }
 
 
@@ -247,11 +1316,20 @@ static void bfree(int dev, uint b, uint n)
 // appending to the end of the inode file. The inodefile has an
 // inum of 0 and starts at sb.startinode.
 //
-// The kernel keeps a cache of in-use inodes in memory
+// The kernel keeps a cache of inodes in memory
 // to provide a place for synchronizing access
 // to inodes used by multiple processes. The cached
 // inodes include book-keeping information that is
-// not stored on disk: ip->ref and ip->flags.
+// not stored on disk: ip->ref and ip->valid.
+//
+// Inodes are found through a hash table keyed on (dev, inum).
+// An inode nobody holds a reference to stays cached, valid, on
+// an LRU list, so opening or statting a recently used file again
+// reads nothing from disk.  Every change to an inode is written
+// through to its dinode, so these are always clean and can be
+// recycled at any time.  The cache starts with a share of free
+// memory (see ICACHE_SHARE in param.h) and grows a page at a
+// time if every inode in it is referenced.
 //
 // Since there is no writing to the file system there is no need
 // for the callers to worry about coherence between the disk
@@ -266,12 +1344,147 @@ static void bfree(int dev, uint b, uint n)
 
 
 
+// Statistics for sysinfo.
+int num_icache_hits = 0;   // iget found the inode cached
+int num_icache_misses = 0; // iget had to take an inode for it
+
+#define NIBUCKET 251 // hash buckets, prime
+#define IHASH(dev, inum) ((((dev) << 24) ^ (inum)) % NIBUCKET)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  int ninode;
+
+  // Hash chains of all cached inodes, through hnext.
+  struct inode *hash[NIBUCKET];
+
+  // Linked list of unreferenced inodes, through prev/next.
+  // lru.next is most recently used.
+  struct inode lru;
+
   struct inode inodefile;
+
+  // Free inums, found at mount and kept up to date by icreate and
+  // iunlink.  Protected by the inodefile's lock.
+  struct ifreepage *ifree;
 } icache;
 
+// A page of the free inum stack.
+struct ifreepage {
+  struct ifreepage *next;
+  uint n;
+  uint inum[(PGSIZE - sizeof(struct ifreepage *) - sizeof(uint)) / sizeof(uint)];
+};
+static_assert(sizeof(struct ifreepage) <= PGSIZE, "ifreepage too big");
+
+// Remember that inum is free.
+// Caller must hold the inodefile's lock.
+static void ifree_push(uint inum) {
+  struct ifreepage *p = icache.ifree;
+
+  if (p == 0 || p->n == NELEM(p->inum)) {
+    if ((p = (struct ifreepage *)kalloc()) == 0)
+      return; // forget it; the inodefile just grows instead
+    p->next = icache.ifree;
+    p->n = 0;
+    icache.ifree = p;
+  }
+  p->inum[p->n++] = inum;
+}
+
+// Take a free inum, or return -1 if there is none.
+// Caller must hold the inodefile's lock.
+static int ifree_pop(void) {
+  struct ifreepage *p = icache.ifree;
+  int inum;
+
+  if (p == 0)
+    return -1;
+  inum = p->inum[--p->n];
+  if (p->n == 0) {
+    icache.ifree = p->next;
+    kfree((char *)p);
+  }
+  return inum;
+}
+
+// Find the free dinodes in the inodefile.  They are pushed last
+// to first, so the lowest inums are reused first.
+static void ifree_init(void) {
+  struct inode *ip = &icache.inodefile;
+  struct dinode *dip;
+  struct buf *bp;
+  uint b, lbn, inum;
+
+  locki(ip);
+  for (lbn = (ip->size + BSIZE - 1) / BSIZE; lbn-- > 0;) {
+    if ((b = ibmap(ip, lbn, 0)) == 0)
+      continue;
+    bp = bread(ip->dev, b);
+    for (inum = (lbn + 1) * IPB; inum-- > lbn * IPB;) {
+      if (INODEOFF(inum) >= ip->size)
+        continue;
+      dip = (struct dinode *)bp->data + inum % IPB;
+      if (dip->size == (uint)-1)
+        ifree_push(inum);
+    }
+    brelse(bp);
+  }
+  unlocki(ip);
+}
+
+// Unlink ip from the LRU list.  Caller must hold icache.lock.
+static void ilru_remove(struct inode *ip) {
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  ip->next = ip->prev = 0;
+}
+
+// Put ip at the most recently used end of the LRU list, or at the
+// least recently used end if it holds nothing worth keeping.
+// Caller must hold icache.lock.
+static void ilru_push(struct inode *ip) {
+  struct inode *at = ip->valid ? &icache.lru : icache.lru.prev;
+
+  ip->next = at->next;
+  ip->prev = at;
+  at->next->prev = ip;
+  at->next = ip;
+}
+
+// Unlink ip from its hash chain, if it is on one.
+// Caller must hold icache.lock.
+static void ihash_remove(struct inode *ip) {
+  struct inode **pp;
+
+  for (pp = &icache.hash[IHASH(ip->dev, ip->inum)]; *pp; pp = &(*pp)->hnext) {
+    if (*pp == ip) {
+      *pp = ip->hnext;
+      break;
+    }
+  }
+  ip->hnext = 0;
+}
+
+// Add a page's worth of inodes to the cache.  Returns the number
+// added, 0 if out of memory.
+static int igrow(void) {
+  struct inode *ip;
+  char *page;
+  int i, n = PGSIZE / sizeof(struct inode);
+
+  if ((page = kalloc()) == 0)
+    return 0;
+  memset(page, 0, PGSIZE);
+  for (i = 0; i < n; i++) {
+    ip = (struct inode *)page + i;
+    initsleeplock(&ip->lock, "inode");
+    ilru_push(ip);
+  }
+  icache.ninode += n;
+  return n;
+}
+
 // Find the inode file on the disk and load it into memory
 // should only be called once, but is idempotent.
 static void init_inodefile(int dev) {
@@ -289,31 +1502,60 @@ static void init_inodefile(int dev) {
 
   icache.inodefile.devid = di.devid;
   icache.inodefile.size = di.size;
-  icache.inodefile.data[0] = di.data[0];
-  for (int i = 1; i < EXTENTS; i++) {
-    di.data[i].startblkno = 0;
-    di.data[i].nblocks = 0;
-    icache.inodefile.data[i] = di.data[i];
-  }
+  memmove(icache.inodefile.data, di.data, sizeof(di.data));
+  icache.inodefile.indirect = di.indirect;
+  icache.inodefile.flags = di.flags;
 
   brelse(b);
+  iloadext(&icache.inodefile);
 }
 
 void iinit(int dev) {
-  int i;
+  int i, want, nreplayed;
+  uint ticks0 = ticks;
+  uint64_t tsc0 = rdtsc();
 
   initlock(&icache.lock, "icache");
-  for (i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  initlock(&log.lock, "log");
+  icache.lru.prev = &icache.lru;
+  icache.lru.next = &icache.lru;
+  want = max(free_pages / ICACHE_SHARE, NINODE / (int)(PGSIZE / sizeof(struct inode)) + 1);
+  for (i = 0; i < want; i++) {
+    if (igrow() == 0)
+      panic("iinit: not enough memory for inodes");
   }
+  cprintf("icache: %d inodes\n", icache.ninode);
   initsleeplock(&icache.inodefile.lock, "inodefile");
+  dinit();
 
   readsb(dev, &sb);
-  cprintf("sb: size %d nblocks %d bmap start %d logstart %d inodestart %d\n", sb.size,
-          sb.nblocks, sb.bmapstart, sb.logstart, sb.inodestart);
+  cprintf("sb: size %d nblocks %d bmap start %d logstart %d nlog %d inodestart %d bsize %d\n", sb.size,
+          sb.nblocks, sb.bmapstart, sb.logstart, sb.nlog, sb.inodestart, sb.bsize);
+  if (sb.bsize != BSIZE)
+    panic("iinit: file system was made with a different BSIZE");
+  if (sb.nlog < MAXOPBLOCKS || sb.nlog > MAXLOGSIZE)
+    panic("iinit: bad log size");
+  log.nlog = sb.nlog;
+  if (log.nlog > bcachesize() - LOGBATCH - MAXOPBLOCKS) {
+    // The rest of the log could never be used (see log_limit).
+    log.nlog = bcachesize() - LOGBATCH - MAXOPBLOCKS;
+    cprintf("log: using %d of %d log blocks, the most the buffer cache can pin\n",
+            log.nlog, sb.nlog);
+  }
   
-  log_apply();
+  nreplayed = log_apply();
+#ifdef FREEMAP_BENCH
+  freemap_bench();
+#endif
+  freemap_init(dev);
+  if (kthread_create("checkpoint", checkpointer) < 0)
+    panic("iinit: checkpointer");
   init_inodefile(dev);
+  ifree_init();
+
+  // crash_safety_test.py --recovery looks for this line.
+  cprintf("mount: replayed %d log blocks in %d ticks, %ld cycles\n",
+          nreplayed, ticks - ticks0, rdtsc() - tsc0);
 }
 
 
@@ -331,55 +1573,72 @@ static void read_dinode(uint inum, struct dinode *dip) {
 
 }
 
-// Update the dinode by writing inode to disk
+// Update the dinode by writing inode to disk.  The dinode is
+// changed in place in its inodefile block: nothing is built on
+// the stack, and since the dinode already exists the inodefile
+// never grows, so this does not nest inside writei.
 void update_dinode(struct inode* ip){
-  int holding_inodefile_lock = holdingsleep(&icache.inodefile.lock);
-  if (!holding_inodefile_lock)
-    locki(&icache.inodefile);
-
-  struct dinode curr_dinode;
-  curr_dinode.type = ip->type;
-  curr_dinode.devid = ip->devid;
-  curr_dinode.size = ip->size;
-  memmove(&curr_dinode.data, &ip->data, sizeof(struct extent) * EXTENTS);
+  struct inode *inodefile = &icache.inodefile;
+  struct dinode *dip;
+  struct buf *bp;
+  uint b;
 
-  if (writei(&icache.inodefile, (char *) &curr_dinode, INODEOFF(ip->inum), sizeof(curr_dinode)) < 0) {
-      panic("update_dinode: error writing inode to disk");
-  }
+  int holding_inodefile_lock = holdingsleep(&inodefile->lock);
+  if (!holding_inodefile_lock)
+    locki(inodefile);
+
+  if (INODEOFF(ip->inum) + sizeof(*dip) > inodefile->size ||
+      (b = ibmap(inodefile, INODEOFF(ip->inum) / BSIZE, 0)) == 0)
+    panic("update_dinode: no such dinode");
+  bp = bread(inodefile->dev, b);
+  dip = (struct dinode *)(bp->data + INODEOFF(ip->inum) % BSIZE);
+  dip->type = ip->type;
+  dip->devid = ip->devid;
+  dip->size = ip->size;
+  memmove(dip->data, ip->data, sizeof(dip->data));
+  dip->indirect = ip->indirect;
+  dip->flags = ip->flags;
+  memset(dip->pad, 0, sizeof(dip->pad));
+  log_write(bp);
+  brelse(bp);
 
   if (!holding_inodefile_lock)
-    unlocki(&icache.inodefile);
+    unlocki(inodefile);
 }
 
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not read
 // the inode from from disk.
 static struct inode *iget(uint dev, uint inum) {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++) {
-    if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-      ip->ref++;
+  for (ip = icache.hash[IHASH(dev, inum)]; ip != 0; ip = ip->hnext) {
+    if (ip->dev == dev && ip->inum == inum) {
+      if (ip->ref++ == 0)
+        ilru_remove(ip);
+      num_icache_hits++;
       release(&icache.lock);
       return ip;
     }
-    if (empty == 0 && ip->ref == 0) // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if (empty == 0)
+  // Recycle the least recently used unreferenced inode.
+  if (icache.lru.prev == &icache.lru && igrow() == 0)
     panic("iget: no inodes");
+  ip = icache.lru.prev;
+  ilru_remove(ip);
+  ihash_remove(ip);
+  num_icache_misses++;
 
-  ip = empty;
   ip->ref = 1;
   ip->valid = 0;
   ip->dev = dev;
   ip->inum = inum;
+  ip->hnext = icache.hash[IHASH(dev, inum)];
+  icache.hash[IHASH(dev, inum)] = ip;
 
   release(&icache.lock);
 
@@ -417,67 +1676,66 @@ struct inode *iopen(char *path) {
 struct inode *concurrent_icreate(char *path) {
   struct inode *inode;
 
-  log_begin_tx();
+  begin_op();
   inode = icreate(path);
-  log_commit_tx();
+  end_op();
 
   return inode;
 }
 
+static int dirslot(struct inode *, char *);
+
 struct inode *icreate(char *path) {
   struct inode *inodefile = &icache.inodefile;
 
-  // Create a new dinode
-  struct dinode dinode;
-  dinode.type = T_FILE;
-  dinode.devid = 0;
-  dinode.size = 0;
-  memset(dinode.data, 0, sizeof(dinode.data));
-
-  // inodefile is an array of dinodes
-  // Search for the first inode in inodefile that is not in use
-  int inum = inodefile->size / sizeof(dinode);
-  for (int i = 0; i < NINODE; i++) {
-    struct dinode dinode;
-    read_dinode(i, &dinode);
-    //cprintf("searching for inum: i %d, size %d\n", i, dinode.size);
-
-    if (dinode.size == -1) {
-      inum = i;
-      break;
-    }
-  }
-  concurrent_writei(inodefile, (char *)&dinode, INODEOFF(inum), sizeof(dinode));
-
-  // Create a new directory entry and write it to the parent directory
+  // Find room for the directory entry first, so that a directory
+  // that cannot take another name leaves nothing to undo.
   char name[DIRSIZ];
   struct inode *parent_dir = nameiparent(path, name);
   struct dirent dirent;
+  struct inode *inode;
 
-  // Search for the first empty directory entry
-  uint off;
-  for (off = 0; off < parent_dir->size; off += sizeof(dirent)) {
-    if (concurrent_readi(parent_dir, (char *)&dirent, off, sizeof(dirent)) != sizeof(dirent))
-      panic("dirlink read");
-    if (dirent.inum == 0)
-        break;
-  }
-  // Create the new directory entry
-  dirent.inum = inum;
-  strncpy(dirent.name, name, DIRSIZ);
-  concurrent_writei(parent_dir, (char *)&dirent, off, sizeof(dirent));
+  locki(parent_dir);
 
-  // Update the size of the inodefile and parent directory
-  acquire(&icache.lock);
-  if (inum >= inodefile->size / sizeof(dinode)) {
-    inodefile->size += sizeof(dinode);
+  // Somebody may have created the file since the caller looked.
+  if ((inode = dirlookup(parent_dir, name, 0)) != 0) {
+    unlocki(parent_dir);
+    locki(inode);
+    unlocki(inode);
+    return inode;
   }
-  if (parent_dir->size == off) {
-    parent_dir->size += sizeof(dirent);
+
+  int off = dirslot(parent_dir, name);
+  if (off < 0) {
+    unlocki(parent_dir);
+    return 0;
   }
-  release(&icache.lock);
 
-  struct inode *inode = iget(inodefile->dev, inum);
+  // Create a new dinode
+  struct dinode dinode;
+  memset(&dinode, 0, sizeof(dinode));
+  dinode.type = T_FILE;
+
+  // inodefile is an array of dinodes
+  // Reuse a free one, or add one at the end
+  locki(inodefile);
+  int inum = ifree_pop();
+  if (inum < 0)
+    inum = inodefile->size / sizeof(dinode);
+  writei(inodefile, (char *)&dinode, INODEOFF(inum), sizeof(dinode));
+  unlocki(inodefile);
+
+  // Write the new directory entry to the parent directory
+  memset(&dirent, 0, sizeof(dirent));
+  dirent.inum = inum;
+  strncpy(dirent.name, name, DIRSIZ);
+  writei(parent_dir, (char *)&dirent, off, sizeof(dirent));
+  if (!(parent_dir->flags & I_DXDIR))
+    parent_dir->dirfree = off + sizeof(dirent);
+  dcache_enter(parent_dir->dev, parent_dir->inum, name, inum, off);
+  unlocki(parent_dir);
+
+  inode = iget(inodefile->dev, inum);
 
   locki(inode);
   unlocki(inode);
@@ -486,6 +1744,18 @@ struct inode *icreate(char *path) {
   return inode;
 }
 
+// Free the blocks preallocated past the end of ip's data by
+// appends (see iextend).  Caller must hold ip's lock and be
+// inside an operation.
+void itrim(struct inode *ip) {
+  uint need = (ip->size + BSIZE - 1) / BSIZE;
+
+  if (ip->nblocks > need) {
+    itruncblocks(ip, need);
+    update_dinode(ip);
+  }
+}
+
 int iunlink(char *path) {
   struct inode *inodefile = &icache.inodefile;
   struct inode *inode = namei(path);
@@ -504,11 +1774,11 @@ int iunlink(char *path) {
   */
 
   acquire(&icache.lock);
-  inode->ref--;  // namei() incremented ref, undo that
-  
   // The file currently has an open reference to it
-  if (inode->ref > 0) {
+  // (besides the one namei() took)
+  if (inode->ref > 1) {
     //cprintf("iunlink error inode has %d open references: %s\n", inode->ref, path);
+    inode->ref--;
     release(&icache.lock);
     return -1;
   }
@@ -519,34 +1789,48 @@ int iunlink(char *path) {
   // Remove the directory entry from the parent directory
   char name[DIRSIZ];
   struct inode *parent_dir = nameiparent(path, name);
+  struct inode *ip;
   struct dirent dirent;
   uint off;
-  for (off = 0; off < parent_dir->size; off += sizeof(dirent)) {
-    if (concurrent_readi(parent_dir, (char *)&dirent, off, sizeof(dirent)) != sizeof(dirent))
-      panic("dirlink read");
-    if (dirent.inum == 0)
-        continue;
-    if (namecmp(dirent.name, name) == 0) {
-      dirent.inum = 0;
-      dirent.name[0] = '\0';
-      concurrent_writei(parent_dir, (char *)&dirent, off, sizeof(dirent));
-      break;
-    }
+  locki(parent_dir);
+  if ((ip = dirlookup(parent_dir, name, &off)) != 0) {
+    irelease(ip);
+    memset(&dirent, 0, sizeof(dirent));
+    writei(parent_dir, (char *)&dirent, off, sizeof(dirent));
+    parent_dir->dirfree = min(parent_dir->dirfree, off);
   }
+  dcache_enter(parent_dir->dev, parent_dir->inum, name, 0, 0);
+  unlocki(parent_dir);
 
   // Remove the dinode from the inodefile
   struct dinode dinode;
   read_dinode(inode->inum, &dinode);
   dinode.size = -1;
-  for (int i = 0; i < EXTENTS; i++) {
-    if (dinode.data[i].nblocks != 0) {
-      bfree(inode->dev, dinode.data[i].startblkno, dinode.data[i].nblocks);
-    }
-    dinode.data[i].startblkno = 0;
-    dinode.data[i].nblocks = 0;
-  }
+  dfree(inode->dev, &dinode);
+  memset(dinode.data, 0, sizeof(dinode.data));
+  dinode.indirect = 0;
+  dinode.flags = 0;
+
+  // The cached copy still describes the old file, whose blocks
+  // were just freed.  Clear it before the inum can be handed out
+  // again, and make it go first when an inode is recycled.
+  locki(inode);
+  inode->valid = 0;
+  inode->type = 0;
+  inode->size = 0;
+  memset(inode->data, 0, sizeof(inode->data));
+  inode->indirect = 0;
+  inode->flags = 0;
+  inode->nextents = 0;
+  inode->nblocks = 0;
+  unlocki(inode);
+
   //cprintf("iunlink: set dinode %d size to -1\n", inode->inum);
-  concurrent_writei(inodefile, (char *)&dinode, INODEOFF(inode->inum), sizeof(dinode));
+  locki(inodefile);
+  writei(inodefile, (char *)&dinode, INODEOFF(inode->inum), sizeof(dinode));
+  ifree_push(inode->inum);
+  unlocki(inodefile);
+  irelease(inode);
 
   return 0;
 }
@@ -562,14 +1846,12 @@ struct inode *idup(struct inode *ip) {
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode stays cached on the
+// LRU list until its entry is recycled.
 void irelease(struct inode *ip) {
   acquire(&icache.lock);
-  // inode has no other references release
-  if (ip->ref == 1)
-    ip->type = 0;
-  ip->ref--;
+  if (--ip->ref == 0)
+    ilru_push(ip);
   release(&icache.lock);
 }
 
@@ -598,6 +1880,10 @@ void locki(struct inode *ip) {
     for (int i = 0; i < EXTENTS; i++) {
       ip->data[i] = dip.data[i];
     }
+    ip->indirect = dip.indirect;
+    ip->flags = dip.flags;
+    iloadext(ip);
+    ip->dirfree = 0;
 
     ip->valid = 1;
 
@@ -650,7 +1936,8 @@ int concurrent_readi(struct inode *ip, char *dst, uint off, uint n) {
 // Returns number of bytes read.
 // Caller must hold ip->lock.
 int readi(struct inode *ip, char *dst, uint off, uint n) {
-  uint tot, m;
+  uint tot, m, lbn;
+  uint lbn0 = 0, pbn0 = 0, run = 0; // last extent looked up
   struct buf *bp;
 
   if (!holdingsleep(&ip->lock))
@@ -667,42 +1954,92 @@ int readi(struct inode *ip, char *dst, uint off, uint n) {
   if (off + n > ip->size)
     n = ip->size - off;
 
-  //cprintf("readi: size %d, off %d, n %d\n", ip->size, off, n);
-  // Search for the extent that contains the starting block
-  int idx_extent = 0;
-  struct extent *cur_extent = ip->data;
-  int total_size_extent = 0;
-  while (total_size_extent + cur_extent->nblocks * BSIZE < off) {
-    total_size_extent += cur_extent->nblocks * BSIZE;
-    idx_extent++;
-    cur_extent++;
-    //cprintf("readi: search extent, idx_extent %d, total_size_extent %d, startblkno %d, nblocks %d\n", idx_extent, total_size_extent, cur_extent->startblkno, cur_extent->nblocks);
-  }
-
-  // Offset into the extent
-  uint off_extent = off - total_size_extent;
-
-  for (tot = 0; tot < n; tot += m, off_extent += m, dst += m) {
-    // Reached the end of the extent
-    if (off_extent >= cur_extent->nblocks * BSIZE) {
-      // Move to the next extent, reset offset and m
-      cur_extent++;
-      off_extent = 0;
-      m = 0;
-      //cprintf("readi: move to next extent, off_extent %d, startblkno %d, nblocks %d\n", off_extent, cur_extent->startblkno, cur_extent->nblocks);
-    } else {
-      // Read from the current extent
-      bp = bread(ip->dev, cur_extent->startblkno + off_extent / BSIZE);
-      m = min(n - tot, BSIZE - off_extent % BSIZE);
-      //cprintf("readi: sizeof(bp->data) %d, n %d, off_extent %d\n", sizeof(bp->data), n, off_extent);
-      memmove(dst, bp->data + off_extent % BSIZE, m);
-      brelse(bp);
+  for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    lbn = off / BSIZE;
+    if (lbn >= lbn0 + run) {
+      pbn0 = ibmap(ip, lbn, &run);
+      lbn0 = lbn;
     }
+    m = min(n - tot, BSIZE - off % BSIZE);
+    if (pbn0 == 0) {
+      memset(dst, 0, m); // a hole
+      continue;
+    }
+    bp = bread(ip->dev, pbn0 + (lbn - lbn0));
+    memmove(dst, bp->data + off % BSIZE, m);
+    brelse(bp);
   }
-  //cprintf("readi: size %d, off %d, n %d, tot %d, total_size_extent %d, off_extent %d\n", ip->size, off, n, tot, total_size_extent, off_extent);
   return n;
 }
 
+// threadsafe readi that also drives the readahead of an open file.
+int concurrent_readi_ahead(struct inode *ip, char *dst, uint off, uint n, struct readahead *ra) {
+  int retval;
+
+  locki(ip);
+  retval = readi(ip, dst, off, n);
+  if (retval > 0)
+    readahead(ip, ra, off, retval);
+  unlocki(ip);
+
+  return retval;
+}
+
+// Queue readahead of the blocks holding bytes [off, off + n) of ip.
+// Extents are contiguous on disk, so each one becomes a single
+// request to the prefetcher.
+// Caller must hold ip->lock.
+static void iprefetch(struct inode *ip, uint off, uint n) {
+  uint b, run, cnt;
+  uint lbn = off / BSIZE;
+  uint lend = min((off + n + BSIZE - 1) / BSIZE, ip->nblocks);
+
+  while (lbn < lend) {
+    b = ibmap(ip, lbn, &run);
+    cnt = min(run, lend - lbn);
+    if (b != 0)
+      bprefetch(ip->dev, b, cnt);
+    lbn += cnt;
+  }
+}
+
+// Account for a read of n bytes at off in the readahead state ra.
+// As long as the reads are sequential, keep the next window of
+// blocks on its way into the buffer cache.  The window starts at
+// RA_MINBLOCKS and doubles up to RA_MAXBLOCKS; a read anywhere
+// else resets it.
+// Caller must hold ip->lock.
+void readahead(struct inode *ip, struct readahead *ra, uint off, uint n) {
+  uint end = off + n;
+  uint limit;
+
+  if (ip->type == T_DEV)
+    return;
+
+  if (off != ra->next) {
+    ra->next = end;
+    ra->ahead = end;
+    ra->window = 0;
+    return;
+  }
+
+  ra->next = end;
+  if (ra->ahead < end)
+    ra->ahead = end;
+
+  // Wait until the reader is within half a window of the blocks
+  // already asked for, then ask for the next window.
+  if (ra->window != 0 && ra->ahead - end >= ra->window * BSIZE / 2)
+    return;
+
+  ra->window = ra->window ? min(ra->window * 2, (uint)RA_MAXBLOCKS) : RA_MINBLOCKS;
+  limit = min(end + ra->window * BSIZE, ip->size);
+  if (limit > ra->ahead) {
+    iprefetch(ip, ra->ahead, limit - ra->ahead);
+    ra->ahead = limit;
+  }
+}
+
 // threadsafe writei.
 int concurrent_writei(struct inode *ip, char *src, uint off, uint n) {
   int retval;
@@ -717,11 +2054,11 @@ int concurrent_writei(struct inode *ip, char *src, uint off, uint n) {
 int log_concurrent_writei(struct inode *ip, char *src, uint off, uint n) {
   int retval;
 
+  begin_op();
   locki(ip);
-  log_begin_tx();
   retval = writei(ip, src, off, n);
-  log_commit_tx();
   unlocki(ip);
+  end_op();
 
   return retval;
 }
@@ -730,6 +2067,12 @@ int log_concurrent_writei(struct inode *ip, char *src, uint off, uint n) {
 // Returns number of bytes written.
 // Caller must hold ip->lock.
 int writei(struct inode *ip, char *src, uint off, uint n) {
+  uint tot, m, lbn, end, need, have, b, fresh;
+  uint lbn0 = 0, pbn0 = 0, run = 0; // last extent looked up
+  uint fill0 = 0, fillend = 0;      // last hole blocks allocated
+  int changed = 0;
+  struct buf *bp;
+
   if (!holdingsleep(&ip->lock))
     panic("not holding lock");
 
@@ -744,267 +2087,330 @@ int writei(struct inode *ip, char *src, uint off, uint n) {
     return -1;
   }
 
-  // Determine the total capacity of the inode with all its extents
-  // and search for the extent that contains the starting block
-  int size = ip->size;
-  int capacity = 0;
-  int idx_extent = 0;
-  int total_size_extent = 0;
-
-  for (int i = 0; i < EXTENTS; i++) {
-    int nblocks = ip->data[i].nblocks;
-    if (nblocks == 0) break;
-
-    capacity += nblocks * BSIZE;
-
-    if (off >= capacity) {
-      // The offset is beyond the current extent
-      idx_extent++;
-      total_size_extent += nblocks * BSIZE;
+  if (off > ip->size) {
+    // Writing past the end: the bytes in between read as zeros.
+    // Clear the rest of the last block, drop what was
+    // preallocated after it, and leave a hole up to off's block.
+    have = (ip->size + BSIZE - 1) / BSIZE;
+    if (ip->size % BSIZE != 0 && (b = ibmap(ip, have - 1, 0)) != 0) {
+      bp = bread(ip->dev, b);
+      memset(bp->data + ip->size % BSIZE, 0, BSIZE - ip->size % BSIZE);
+      log_write(bp);
+      brelse(bp);
     }
+    itruncblocks(ip, have);
+    if (off / BSIZE > have)
+      iaddblocks(ip, 0, off / BSIZE - have);
+    changed = 1;
   }
-
-  if (off > size) {
-    off = size;
-  }
-  // Offset into the extent
-  int off_extent = 0;
-  int diff = off - total_size_extent;
-  if (diff > 0) {
-    off_extent = diff;
-  } 
-
-  int n_overwrite = size - off;
-  if (n_overwrite > n && n_overwrite > 0) {
-    n_overwrite = n;
+  end = off + n;
+
+  // Blocks past the end of the data, whether allocated by this
+  // write or preallocated by an earlier one, start out as zeros,
+  // not as whatever is on disk, and are not read first.
+  fresh = (ip->size + BSIZE - 1) / BSIZE;
+  need = (end + BSIZE - 1) / BSIZE;
+  if (need > ip->nblocks) {
+    iextend(ip, need - ip->nblocks);
+    changed = 1;
   }
-  int n_append = off + n - size;
-  //assertm(n_overwrite + n_append == n, "n_overwrite + n_append != n");
-  //cprintf("writei: INUM %d, idx_extent %d, size %d, off %d, off_extent %d, n %d, n_overwrite %d, n_append %d, capacity %d\n", ip->inum, idx_extent, size, off, off_extent, n, n_overwrite, n_append, capacity);
 
-  int retval = 0;
-  if (n_overwrite > 0) {
-    log_writei_file(ip, src, off_extent, n_overwrite, idx_extent);
-    retval += n_overwrite;
+  for (tot = 0; tot < n; tot += m, off += m, src += m) {
+    lbn = off / BSIZE;
+    if (lbn >= lbn0 + run) {
+      pbn0 = ibmap(ip, lbn, &run);
+      lbn0 = lbn;
+      if (pbn0 == 0) {
+        // Allocate only the part of the hole being written.
+        run = min(run, (end - 1) / BSIZE + 1 - lbn);
+        pbn0 = ifill(ip, lbn, run);
+        fill0 = lbn;
+        fillend = lbn + run;
+        changed = 1;
+      }
+    }
+    m = min(n - tot, BSIZE - off % BSIZE);
+    if (lbn >= fresh || (lbn >= fill0 && lbn < fillend)) {
+      bp = bgetblk(ip->dev, pbn0 + (lbn - lbn0));
+      memset(bp->data, 0, BSIZE);
+    } else {
+      bp = bread(ip->dev, pbn0 + (lbn - lbn0));
+    }
+    memmove(bp->data + off % BSIZE, src, m);
+    log_write(bp);
+    brelse(bp);
   }
 
-  if (n_append > 0) {
-    int n_balloc = off + n - capacity;
-    log_writei_append(ip, src, off_extent, n_append, n_balloc, idx_extent);
-    retval += n_append;
-    ip->size += n_append;
+  if (end > ip->size || changed) {
+    ip->size = max(ip->size, end);
     update_dinode(ip);
   }
-
-  return retval;
+  return n;
 }
 
-int writei_file(struct inode *ip, char *src, int off_extent, int n, int idx_extent) {
-  int tot, m;
+// Directories
+
+int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
+
+// Return the byte offset of the first entry of directory dp in
+// [off, end) that is named name, or that is free if name is 0.
+// Returns end if there is none.  If inum is not 0, set *inum to
+// the inum of the entry found.  Each directory block is read
+// once and its entries compared in place.
+// Caller must hold dp->lock.
+static uint dirscan(struct inode *dp, uint off, uint end, char *name,
+                    uint *inum) {
+  struct dirent *de;
   struct buf *bp;
-  struct extent *cur_extent = ip->data + idx_extent;
-
-  for (tot = 0; tot < n; tot += m, off_extent += m, src += m) {
-    // Reached the end of the extent
-    if (off_extent >= cur_extent->nblocks * BSIZE) {
-      // Move to the next extent, reset offset and m
-      
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, prev extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-      cur_extent++;
-      off_extent = 0;
-      m = 0;
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, next extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-    } else {
-      // Write to the current extent
-      if (cur_extent->startblkno >= FSSIZE) {
-        for (int i = 0; i < EXTENTS; i++) {
-          //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, startblkno %d, nblocks %d. off_extent %d, idx_extend %d\n", ip->inum, ip->data[i].startblkno, ip->data[i].nblocks, off_extent, idx_extent);
-        }
-        //cprintf("writei_file: startblkno %d >= FSSIZE %d\n", cur_extent->startblkno, FSSIZE);
+  uint lbn, b, bend;
+
+  for (; off < end; off = (lbn + 1) * BSIZE) {
+    lbn = off / BSIZE;
+    if ((b = ibmap(dp, lbn, 0)) == 0) {
+      // A hole reads as free entries.
+      if (name == 0)
+        break;
+      continue;
+    }
+    bend = min(end, (lbn + 1) * BSIZE);
+    bp = bread(dp->dev, b);
+    for (; off < bend; off += sizeof(*de)) {
+      de = (struct dirent *)(bp->data + off % BSIZE);
+      if (name == 0 ? de->inum == 0
+                    : de->inum != 0 && namecmp(name, de->name) == 0) {
+        if (inum)
+          *inum = de->inum;
+        brelse(bp);
+        return off;
       }
-      bp = bread(ip->dev, cur_extent->startblkno + off_extent / BSIZE);
-      m = min(n - tot, BSIZE - off_extent % BSIZE);
-      memmove(bp->data + off_extent % BSIZE, src, m);
-      bwrite(bp);
-      brelse(bp);
     }
+    brelse(bp);
   }
-  return n;
+  return min(off, end);
 }
 
-int writei_append(struct inode *ip, char *src, int off_extent, int n_append, int n_balloc, int idx_extent) {
-  struct extent *cur_extent = ip->data + idx_extent;
+// Indexed directories (see fs.h).
 
-  if (n_balloc > 0) {
-    // Allocate new blocks
-    int nblocks = n_balloc / BSIZE + (n_balloc % BSIZE == 0 ? 0 : 1);
-    int startblkno = balloc(ip->dev, nblocks);
+static_assert(sizeof(struct dxentry) == sizeof(struct dirent),
+              "dxentry must fill a dirent slot");
+static_assert(sizeof(struct dxblock) <= BSIZE, "dxblock too big");
 
-    // The inode has already an extent at idx_extent, move to the next extent
-    int allocated_extent = idx_extent;
-    while (cur_extent->nblocks != 0) {
-      allocated_extent++;
-      cur_extent++;
-    }
-    
-    // Update inode
-    cprintf("writei_append: INUM %d, allocate %d bytes for extent %d, nblocks %d, startblkno %d\n", ip->inum, n_balloc, allocated_extent, nblocks, startblkno);
-    cur_extent->startblkno = startblkno;
-    cur_extent->nblocks = nblocks;
-  }
+// FNV-1a hash of a directory entry name.
+static uint dxhash(char *name) {
+  uint h = 2166136261;
+  int i;
 
-  int tot, m;
-  struct buf *bp;
-  cur_extent = ip->data + idx_extent;
-
-  for (tot = 0; tot < n_append; tot += m, off_extent += m, src += m) {
-    // Reached the end of the extent
-    if (off_extent >= cur_extent->nblocks * BSIZE) {
-      // Move to the next extent, reset offset and m
-      
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, prev extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-      cur_extent++;
-      off_extent = 0;
-      m = 0;
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, next extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-    } else {
-      // Write to the current extent
-      if (cur_extent->startblkno >= FSSIZE) {
-        for (int i = 0; i < EXTENTS; i++) {
-          //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, startblkno %d, nblocks %d. off_extent %d, idx_extend %d\n", ip->inum, ip->data[i].startblkno, ip->data[i].nblocks, off_extent, idx_extent);
-        }
-        //cprintf("writei_file: startblkno %d >= FSSIZE %d\n", cur_extent->startblkno, FSSIZE);
-      }
-      bp = bread(ip->dev, cur_extent->startblkno + off_extent / BSIZE);
-      m = min(n_append - tot, BSIZE - off_extent % BSIZE);
-      memmove(bp->data + off_extent % BSIZE, src, m);
-      bwrite(bp);
-      brelse(bp);
-    }
+  for (i = 0; i < DIRSIZ && name[i] != 0; i++) {
+    h ^= (uchar)name[i];
+    h *= 16777619;
   }
-
-  // TODO: update dinode in inodefile
-  return n_append;
+  return h;
 }
 
-int log_writei_file(struct inode *ip, char *src, int off_extent, int n, int idx_extent) {
-  int tot, m;
+// Return the leaf of indexed directory dp for names hashing to h,
+// and set *slot (if not null) to its position in the index.
+// Caller must hold dp->lock.
+static uint dxleaf(struct inode *dp, uint h, uint *slot) {
+  struct dxblock *dx;
   struct buf *bp;
-  struct extent *cur_extent = ip->data + idx_extent;
-
-  for (tot = 0; tot < n; tot += m, off_extent += m, src += m) {
-    // Reached the end of the extent
-    if (off_extent >= cur_extent->nblocks * BSIZE) {
-      // Move to the next extent, reset offset and m
-      
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, prev extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-      cur_extent++;
-      off_extent = 0;
-      m = 0;
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, next extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-    } else {
-      // Write to the current extent
-      if (cur_extent->startblkno >= FSSIZE) {
-        for (int i = 0; i < EXTENTS; i++) {
-          //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, startblkno %d, nblocks %d. off_extent %d, idx_extend %d\n", ip->inum, ip->data[i].startblkno, ip->data[i].nblocks, off_extent, idx_extent);
-        }
-        //cprintf("writei_file: startblkno %d >= FSSIZE %d\n", cur_extent->startblkno, FSSIZE);
-      }
-      bp = bread(ip->dev, cur_extent->startblkno + off_extent / BSIZE);
-      m = min(n - tot, BSIZE - off_extent % BSIZE);
-      memmove(bp->data + off_extent % BSIZE, src, m);
-      log_write(bp);
-      brelse(bp);
-    }
+  uint lo, hi, mid, lblk;
+
+  bp = bread(dp->dev, ibmap(dp, 0, 0));
+  dx = (struct dxblock *)bp->data;
+  if (dx->magic != DX_MAGIC || dx->nleaf == 0 || dx->nleaf > NDXLEAF)
+    panic("dxleaf: bad index");
+
+  // The last entry whose hash is at most h.
+  lo = 0;
+  hi = dx->nleaf;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (dx->e[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid;
   }
-  return n;
+  lblk = dx->e[lo].lblk;
+  if (slot)
+    *slot = lo;
+  brelse(bp);
+  return lblk;
 }
 
-int log_writei_append(struct inode *ip, char *src, int off_extent, int n_append, int n_balloc, int idx_extent) {
-  struct extent *cur_extent = ip->data + idx_extent;
+// Add a block of free entries to the end of directory dp and
+// return its number.  Caller must hold dp->lock.
+static uint dirgrow(struct inode *dp) {
+  struct dirent de;
+  uint lblk = (dp->size + BSIZE - 1) / BSIZE;
 
-  if (n_balloc > 0) {
-    // Allocate new blocks
-    int nblocks = n_balloc / BSIZE + (n_balloc % BSIZE == 0 ? 0 : 1);
-    int startblkno = balloc(ip->dev, nblocks);
+  memset(&de, 0, sizeof(de));
+  writei(dp, (char *)&de, (lblk + 1) * BSIZE - sizeof(de), sizeof(de));
+  return lblk;
+}
 
-    // The inode has already an extent at idx_extent, move to the next extent
-    int allocated_extent = idx_extent;
-    while (cur_extent->nblocks != 0) {
-      allocated_extent++;
-      cur_extent++;
-    }
-    
-    // Update inode
-    cprintf("writei_append: INUM %d, allocate %d bytes for extent %d, nblocks %d, startblkno %d\n", ip->inum, n_balloc, allocated_extent, nblocks, startblkno);
-    cur_extent->startblkno = startblkno;
-    cur_extent->nblocks = nblocks;
-  }
+// Give directory dp, whose one block is full, an index: its
+// entries move to a new leaf covering every hash, and block 0
+// becomes the index.  Caller must hold dp->lock.
+static void dxconvert(struct inode *dp) {
+  struct dxblock *dx;
+  struct dirent *de;
+  struct buf *ibp, *lbp;
+  uint lblk, i;
+
+  lblk = dirgrow(dp);
+  ibp = bread(dp->dev, ibmap(dp, 0, 0));
+  lbp = bread(dp->dev, ibmap(dp, lblk, 0));
+  memmove(lbp->data, ibp->data, BSIZE);
+  de = (struct dirent *)lbp->data;
+  for (i = 0; i < DPB; i++)
+    if (de[i].inum != 0)
+      dcache_move(dp->dev, dp->inum, de[i].name,
+                  lblk * BSIZE + i * sizeof(*de));
+
+  memset(ibp->data, 0, BSIZE);
+  dx = (struct dxblock *)ibp->data;
+  dx->magic = DX_MAGIC;
+  dx->nleaf = 1;
+  dx->e[0].lblk = lblk;
+  log_write(ibp);
+  log_write(lbp);
+  brelse(lbp);
+  brelse(ibp);
+
+  dp->flags |= I_DXDIR;
+  update_dinode(dp);
+}
 
-  int tot, m;
-  struct buf *bp;
-  cur_extent = ip->data + idx_extent;
-
-  for (tot = 0; tot < n_append; tot += m, off_extent += m, src += m) {
-    // Reached the end of the extent
-    if (off_extent >= cur_extent->nblocks * BSIZE) {
-      // Move to the next extent, reset offset and m
-      
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, prev extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-      cur_extent++;
-      off_extent = 0;
-      m = 0;
-      //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, next extent m %d, off_extent %d, startblkno %d, nblocks %d\n", ip->inum, m, off_extent, cur_extent->startblkno, cur_extent->nblocks);
-    } else {
-      // Write to the current extent
-      if (cur_extent->startblkno >= FSSIZE) {
-        for (int i = 0; i < EXTENTS; i++) {
-          //if (cur_extent->nblocks != 0) cprintf("writei_file: INUM %d, startblkno %d, nblocks %d. off_extent %d, idx_extend %d\n", ip->inum, ip->data[i].startblkno, ip->data[i].nblocks, off_extent, idx_extent);
-        }
-        //cprintf("writei_file: startblkno %d >= FSSIZE %d\n", cur_extent->startblkno, FSSIZE);
-      }
-      bp = bread(ip->dev, cur_extent->startblkno + off_extent / BSIZE);
-      m = min(n_append - tot, BSIZE - off_extent % BSIZE);
-      memmove(bp->data + off_extent % BSIZE, src, m);
-      log_write(bp);
-      brelse(bp);
-    }
+// Split the full leaf at position slot of directory dp's index:
+// the names in the upper half of its hash range move to a new
+// leaf.  Returns -1 if the index is full or every name in the
+// leaf has the same hash.  Caller must hold dp->lock.
+static int dxsplit(struct inode *dp, uint slot) {
+  struct dxblock *dx;
+  struct dirent *de, *nde;
+  struct buf *ibp, *obp, *nbp;
+  uint *h, olblk, nlblk, split, i, j, t;
+
+  ibp = bread(dp->dev, ibmap(dp, 0, 0));
+  dx = (struct dxblock *)ibp->data;
+  olblk = dx->e[slot].lblk;
+  i = dx->nleaf;
+  brelse(ibp);
+  if (i == NDXLEAF)
+    return -1;
+
+  // Split at the median hash, or past it if the names up to it
+  // all have the lowest hash.
+  if ((h = (uint *)kalloc()) == 0)
+    return -1;
+  obp = bread(dp->dev, ibmap(dp, olblk, 0));
+  de = (struct dirent *)obp->data;
+  for (i = 0; i < DPB; i++) {
+    t = dxhash(de[i].name);
+    for (j = i; j > 0 && h[j - 1] > t; j--)
+      h[j] = h[j - 1];
+    h[j] = t;
   }
+  brelse(obp);
+  for (i = DPB / 2; i < DPB && h[i] == h[0]; i++)
+    ;
+  split = i < DPB ? h[i] : 0;
+  kfree((char *)h);
+  if (split == 0)
+    return -1;
 
-  return n_append;
+  nlblk = dirgrow(dp);
+  ibp = bread(dp->dev, ibmap(dp, 0, 0));
+  obp = bread(dp->dev, ibmap(dp, olblk, 0));
+  nbp = bread(dp->dev, ibmap(dp, nlblk, 0));
+  dx = (struct dxblock *)ibp->data;
+  de = (struct dirent *)obp->data;
+  nde = (struct dirent *)nbp->data;
+  for (i = j = 0; i < DPB; i++) {
+    if (dxhash(de[i].name) < split)
+      continue;
+    nde[j] = de[i];
+    dcache_move(dp->dev, dp->inum, nde[j].name,
+                nlblk * BSIZE + j * sizeof(*nde));
+    memset(&de[i], 0, sizeof(de[i]));
+    j++;
+  }
+  memmove(dx->e + slot + 2, dx->e + slot + 1,
+          (dx->nleaf - slot - 1) * sizeof(dx->e[0]));
+  memset(&dx->e[slot + 1], 0, sizeof(dx->e[0]));
+  dx->e[slot + 1].hash = split;
+  dx->e[slot + 1].lblk = nlblk;
+  dx->nleaf++;
+  log_write(ibp);
+  log_write(obp);
+  log_write(nbp);
+  brelse(nbp);
+  brelse(obp);
+  brelse(ibp);
+  return 0;
 }
 
-// Directories
-
-int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
+// Return the byte offset at which to add an entry named name to
+// directory dp, growing the directory or its index as needed, or
+// -1 if there is no room.  A directory gets an index when its
+// first block is full.  Caller must hold dp->lock.
+static int dirslot(struct inode *dp, char *name) {
+  uint off, lblk, slot, h;
+
+  if (!(dp->flags & I_DXDIR)) {
+    off = dirscan(dp, dp->dirfree, dp->size, 0, 0);
+    if (off < dp->size || dp->size != BSIZE)
+      return off;
+    dxconvert(dp);
+  }
 
-struct inode *rootlookup(char *name) {
-  return dirlookup(namei("/"), name, 0);
+  // Splitting a full leaf leaves room on both sides.
+  h = dxhash(name);
+  for (;;) {
+    lblk = dxleaf(dp, h, &slot);
+    off = dirscan(dp, lblk * BSIZE, (lblk + 1) * BSIZE, 0, 0);
+    if (off < (lblk + 1) * BSIZE)
+      return off;
+    if (dxsplit(dp, slot) < 0)
+      return -1;
+  }
 }
 
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, start, end;
 
   if (dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if (de.inum == 0)
-      continue;
-    if (namecmp(name, de.name) == 0) {
-      // entry matches path element
-      if (poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
-    }
+  if (dcache_lookup(dp->dev, dp->inum, name, &inum, &off)) {
+    num_dcache_hits++;
+    if (inum == 0)
+      return 0;
+    if (poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+  num_dcache_misses++;
+
+  // An indexed directory has only one block the name can be in.
+  start = 0;
+  end = dp->size;
+  if (dp->flags & I_DXDIR) {
+    start = dxleaf(dp, dxhash(name), 0) * BSIZE;
+    end = start + BSIZE;
+  }
+
+  if ((off = dirscan(dp, start, end, name, &inum)) < end) {
+    // entry matches path element
+    if (poff)
+      *poff = off;
+    dcache_enter(dp->dev, dp->inum, name, inum, off);
+    return iget(dp->dev, inum);
   }
 
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   return 0;
 }
 
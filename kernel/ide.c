@@ -1,11 +1,15 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code.  Transfers use PCI bus-master DMA when the
+// controller supports it (QEMU's PIIX3 does) and programmed I/O
+// otherwise.
 
 #include <cdefs.h>
 #include <defs.h>
 #include <fs.h>
+#include <iosched.h>
 #include <memlayout.h>
 #include <mmu.h>
 #include <param.h>
+#include <pci.h>
 #include <proc.h>
 #include <sleeplock.h>
 #include <spinlock.h>
@@ -24,16 +28,63 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_READDMA 0xc8
+#define IDE_CMD_WRITEDMA 0xca
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+// Bus master registers of the primary channel, relative to BAR4
+// of the IDE controller.
+#define BM_CMD 0
+#define BM_STATUS 2
+#define BM_PRDT 4
+#define BM_CMD_START 0x01
+#define BM_CMD_READ 0x08 // device to memory
+#define BM_STATUS_ERR 0x02
+#define BM_STATUS_INTR 0x04
+
+#define IDE_MULT 16     // sectors per interrupt we ask for in multiple mode
+#define IDE_MAXSECT 128 // sectors in one command
+
+// idequeue holds the bufs waiting for the disk, in the order the
+// IOSCHED policy hands them out.  ideactive points to the bufs
+// of the command the disk is working on: queued bufs for
+// consecutive blocks in the same direction, linked by qnext.
+// ide_xbuf and ide_xoff say where the next sector goes to or
+// comes from.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
-static struct buf *idequeue;
+static struct ioqueue idequeue;
+static struct buf *ideactive;
+
+static int ide_nsect;         // sectors in the active command
+static int ide_done;          // sectors transferred so far
+static struct buf *ide_xbuf;  // buf of the next sector
+static int ide_xoff;          // offset of the next sector in ide_xbuf
+
+static int idemult = 1; // sectors per interrupt, 1 if not in multiple mode
+
+// Physical region descriptor: one physically contiguous piece of
+// a DMA transfer.  A region may not cross a 64 KiB boundary and
+// neither may the table, hence its alignment.
+struct prd {
+  uint addr;
+  ushort len;
+  ushort flags;
+};
+#define PRD_EOT 0x8000 // last entry of the table
+#define PRD_MAXLEN 0x8000
+
+static struct prd prdt[IDE_MAXSECT]
+    __attribute__((aligned(sizeof(struct prd) * IDE_MAXSECT)));
+static ushort idebm; // bus master I/O base, 0 to use PIO
+static int ide_dma;  // the active command uses DMA
+
+int ideirq = IRQ_IDE;
 
 static int havedisk1;
-static void idestart(struct buf *);
+static void idestart(void);
+static void idecommand(void);
 
 // Wait for IDE disk to become ready.
 static int idewait(int checkerr) {
@@ -50,6 +101,7 @@ void ideinit(void) {
   int i;
 
   initlock(&idelock, "ide");
+  ioqinit(&idequeue, &IOSCHED);
   picenable(IRQ_IDE);
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
@@ -65,32 +117,129 @@ void ideinit(void) {
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0 << 4));
+
+  // Ask for IDE_MULT sectors per interrupt.  Polled, with the
+  // interrupt masked; idestart unmasks it again.
+  outb(0x3f6, 2);
+  idemult = IDE_MULT;
+  for (i = 0; i <= havedisk1; i++) {
+    outb(0x1f6, 0xe0 | (i << 4));
+    outb(0x1f2, IDE_MULT);
+    outb(0x1f7, IDE_CMD_SETMUL);
+    if (idewait(1) < 0)
+      idemult = 1;
+  }
+  outb(0x1f6, 0xe0 | (0 << 4));
+
+  // Use DMA if there is a PCI IDE controller with bus master
+  // registers.
+  struct pcifunc f;
+  if (pcifindclass(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &f) == 0 &&
+      (f.bar[4] & PCI_BAR_IO)) {
+    pcienable(&f, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    idebm = PCI_BAR_IOADDR(f.bar[4]);
+  }
+}
+
+// Fill prdt with the data of the bufs of the active command,
+// merging bufs that happen to be physically adjacent.
+static void ideprdt(void) {
+  struct buf *b;
+  uint pa;
+  int n = 0;
+
+  for (b = ideactive; b != 0; b = b->qnext) {
+    pa = V2P(b->data);
+    if (n > 0 && prdt[n - 1].addr + prdt[n - 1].len == pa &&
+        pa % 0x10000 != 0 && prdt[n - 1].len + BSIZE <= PRD_MAXLEN) {
+      prdt[n - 1].len += BSIZE;
+      continue;
+    }
+    prdt[n].addr = pa;
+    prdt[n].len = BSIZE;
+    prdt[n].flags = 0;
+    n++;
+  }
+  prdt[n - 1].flags = PRD_EOT;
+}
+
+// Move n sectors between the data port and the bufs of the
+// active command, starting at ide_xbuf.  Caller must hold idelock.
+static void idexfer(int n, int write) {
+  for (; n > 0; n--) {
+    if (write)
+      outsl(0x1f0, ide_xbuf->data + ide_xoff, SECTOR_SIZE / 4);
+    else
+      insl(0x1f0, ide_xbuf->data + ide_xoff, SECTOR_SIZE / 4);
+    ide_done++;
+    ide_xoff += SECTOR_SIZE;
+    if (ide_xoff == BSIZE) {
+      ide_xbuf = ide_xbuf->qnext;
+      ide_xoff = 0;
+    }
+  }
 }
 
-// Start the request for b.  Caller must hold idelock.
-static void idestart(struct buf *b) {
-  if (b == 0)
-    panic("idestart");
-  if (b->blockno >= FSSIZE)
-    panic("incorrect blockno");
+// Start the next command the scheduler hands out, if any: the
+// request it picks plus queued requests for the blocks right
+// after it.  Caller must hold idelock.
+static void idestart(void) {
+  struct buf *b, *p;
+
   int sector_per_block = BSIZE / SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ : IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
-  if (sector_per_block > 7)
-    panic("idestart");
+  if ((b = ioqnext(&idequeue, IDE_MAXSECT / sector_per_block)) == 0)
+    return;
+
+  ide_nsect = 0;
+  for (p = b; p != 0; p = p->qnext) {
+    if (p->blockno >= FSSIZE)
+      panic("incorrect blockno");
+    ide_nsect += sector_per_block;
+  }
+  ideactive = b;
+  idecommand();
+}
+
+// Issue the command for the bufs in ideactive.
+// Caller must hold idelock.
+static void idecommand(void) {
+  struct buf *b = ideactive;
+  int write = (b->flags & B_DIRTY) != 0;
+  int sector = b->blockno * (BSIZE / SECTOR_SIZE);
+  int read_cmd = (idemult == 1) ? IDE_CMD_READ : IDE_CMD_RDMUL;
+  int write_cmd = (idemult == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+
+  ide_done = 0;
+  ide_xbuf = b;
+  ide_xoff = 0;
+  ide_dma = idebm != 0;
+  num_disk_cmds++;
+  num_disk_sectors += ide_nsect;
+
+  if (ide_dma) {
+    ideprdt();
+    outl(idebm + BM_PRDT, V2P(prdt));
+    outb(idebm + BM_CMD, write ? 0 : BM_CMD_READ);
+    outb(idebm + BM_STATUS,
+         inb(idebm + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_INTR);
+    read_cmd = IDE_CMD_READDMA;
+    write_cmd = IDE_CMD_WRITEDMA;
+  }
 
   idewait(0);
-  outb(0x3f6, 0);                // generate interrupt
-  outb(0x1f2, sector_per_block); // number of sectors
+  outb(0x3f6, 0);         // generate interrupt
+  outb(0x1f2, ide_nsect); // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
-  if (b->flags & B_DIRTY) {
+  if (ide_dma) {
+    outb(0x1f7, write ? write_cmd : read_cmd);
+    outb(idebm + BM_CMD, (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+  } else if (write) {
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE / 4);
+    idexfer(min(idemult, ide_nsect), 1);
   } else {
     outb(0x1f7, read_cmd);
   }
@@ -100,37 +249,64 @@ static void idestart(struct buf *b) {
 void ideintr(void) {
   struct buf *b;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
-  if ((b = idequeue) == 0) {
+  if ((b = ideactive) == 0) {
     release(&idelock);
     // cprintf("spurious IDE interrupt\n");
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE / 4);
+  // With DMA the drive interrupts once, when the whole command
+  // is done.  With PIO it interrupts once per idemult sectors:
+  // move the next chunk and wait for the following interrupt,
+  // unless the command is finished or failed.
+  if (ide_dma) {
+    // If the transfer failed, do it over with PIO and stay with
+    // PIO from now on.
+    uchar st = inb(idebm + BM_STATUS);
+    outb(idebm + BM_CMD, 0);
+    outb(idebm + BM_STATUS, st | BM_STATUS_ERR | BM_STATUS_INTR);
+    if (idewait(1) < 0 || (st & BM_STATUS_ERR)) {
+      cprintf("ide: DMA failed, falling back to PIO\n");
+      idebm = 0;
+      idecommand();
+      release(&idelock);
+      return;
+    }
+    ide_done = ide_nsect;
+  } else if (idewait(1) < 0) {
+    ide_done = ide_nsect;
+  } else if (!(b->flags & B_DIRTY)) {
+    idexfer(min(idemult, ide_nsect - ide_done), 0);
+  } else if (ide_done < ide_nsect) {
+    idexfer(min(idemult, ide_nsect - ide_done), 1);
+    release(&idelock);
+    return;
+  }
+  if (ide_done < ide_nsect) {
+    release(&idelock);
+    return;
+  }
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for the bufs of this command.
+  for (; b != 0; b = b->qnext) {
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+  }
+  ideactive = 0;
 
   // Start disk on next buf in queue.
-  if (idequeue != 0)
-    idestart(idequeue);
+  idestart();
 
   release(&idelock);
 }
 
-// Sync buf with disk.
+// Queue b for the disk and return without waiting for it.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
-void iderw(struct buf *b) {
-  struct buf **pp;
-
+// b must stay locked until iderw_wait(b) returns.
+void iderw_submit(struct buf *b) {
   if (!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
   if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
@@ -140,20 +316,32 @@ void iderw(struct buf *b) {
 
   acquire(&idelock); // DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for (pp = &idequeue; *pp; pp = &(*pp)->qnext) // DOC:insert-queue
-    ;
-  *pp = b;
+  ioqadd(&idequeue, b);
 
   // Start disk if necessary.
-  if (idequeue == b)
-    idestart(b);
+  if (ideactive == 0)
+    idestart();
+
+  release(&idelock);
+}
 
-  // Wait for request to finish.
+// Wait for the request submitted for b to finish.
+// Returns right away if b has nothing pending.
+void iderw_wait(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("iderw_wait: buf not locked");
+
+  acquire(&idelock);
   while ((b->flags & (B_VALID | B_DIRTY)) != B_VALID) {
     sleep(b, &idelock);
   }
-
   release(&idelock);
 }
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void iderw(struct buf *b) {
+  iderw_submit(b);
+  iderw_wait(b);
+}
@@ -0,0 +1,175 @@
+// Disk request scheduling.
+//
+// A driver keeps its pending requests in a struct ioqueue: it
+// adds bufs with ioqadd and, whenever the disk goes idle, takes
+// the next command's worth with ioqnext.  Which request goes
+// next is up to the queue's policy:
+//
+// * iosched_elevator serves requests in C-LOOK order: upward
+//     in block number from where the last request ended, then
+//     back around to the lowest pending block.  Reads go before
+//     writes, since a process is waiting on every read while
+//     most writes come from commits and checkpoints.  There is
+//     no aging: a steady stream of reads starves every write,
+//     and with it the checkpointer and any process waiting for
+//     log space.  It is here for comparison only.
+//
+// * iosched_deadline does the same, except that a request
+//     that has waited longer than its deadline is served first,
+//     so a stream of reads cannot starve writeback forever.
+//     This is the only policy safe to run a real workload on.
+//
+// Both lists have tail pointers.  Adding to the arrival list is
+// O(1), and so is adding to the sorted list in the common case
+// of blocks submitted in ascending order.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <iosched.h>
+#include <param.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+
+#include <buf.h>
+
+#define READ_EXPIRE 5   // ticks a read may wait under iosched_deadline
+#define WRITE_EXPIRE 50 // ticks a write may wait under iosched_deadline
+
+static int bdir(struct buf *b) {
+  return (b->flags & B_DIRTY) ? IOQ_WRITE : IOQ_READ;
+}
+
+// Does (dev, blockno) sort before b?
+static int before(uint dev, uint blockno, struct buf *b) {
+  return dev < b->dev || (dev == b->dev && blockno < b->blockno);
+}
+
+void ioqinit(struct ioqueue *q, struct iosched *sched) {
+  memset(q, 0, sizeof(*q));
+  q->sched = sched;
+}
+
+int ioqempty(struct ioqueue *q) {
+  return q->fifo[IOQ_READ] == 0 && q->fifo[IOQ_WRITE] == 0;
+}
+
+// Add b to the pending requests.
+void ioqadd(struct ioqueue *q, struct buf *b) {
+  struct buf *p;
+  int d = bdir(b);
+
+  b->qtime = ticks;
+
+  // Arrival order.
+  b->fnext = 0;
+  b->fprev = q->fifotail[d];
+  if (q->fifotail[d])
+    q->fifotail[d]->fnext = b;
+  else
+    q->fifo[d] = b;
+  q->fifotail[d] = b;
+
+  // Block order.  Search from the tail, where ascending runs end.
+  for (p = q->sortedtail[d]; p != 0 && before(b->dev, b->blockno, p);
+       p = p->qprev)
+    ;
+  b->qprev = p;
+  b->qnext = p ? p->qnext : q->sorted[d];
+  if (b->qnext)
+    b->qnext->qprev = b;
+  else
+    q->sortedtail[d] = b;
+  if (p)
+    p->qnext = b;
+  else
+    q->sorted[d] = b;
+}
+
+static void ioqremove(struct ioqueue *q, struct buf *b) {
+  int d = bdir(b);
+
+  if (b->fprev)
+    b->fprev->fnext = b->fnext;
+  else
+    q->fifo[d] = b->fnext;
+  if (b->fnext)
+    b->fnext->fprev = b->fprev;
+  else
+    q->fifotail[d] = b->fprev;
+
+  if (b->qprev)
+    b->qprev->qnext = b->qnext;
+  else
+    q->sorted[d] = b->qnext;
+  if (b->qnext)
+    b->qnext->qprev = b->qprev;
+  else
+    q->sortedtail[d] = b->qprev;
+}
+
+// Take the request the policy picks, along with up to max - 1
+// requests for the blocks right after it in the same direction.
+// Returns them linked by qnext, or 0 if nothing is pending.
+struct buf *ioqnext(struct ioqueue *q, int max) {
+  struct buf *b, *last, *next;
+  int n;
+
+  if (ioqempty(q))
+    return 0;
+
+  b = q->sched->pick(q);
+  next = b->qnext;
+  ioqremove(q, b);
+  last = b;
+  for (n = 1; n < max && next != 0 && next->dev == last->dev &&
+              next->blockno == last->blockno + 1;
+       n++) {
+    last->qnext = next;
+    last = next;
+    next = next->qnext;
+    ioqremove(q, last);
+  }
+  last->qnext = 0;
+
+  q->dev = last->dev;
+  q->blockno = last->blockno + 1;
+  return b;
+}
+
+// C-LOOK: the first request at or past the end of the last one,
+// or the lowest if there is none.
+static struct buf *clook(struct ioqueue *q, int d) {
+  struct buf *b;
+
+  for (b = q->sorted[d]; b != 0; b = b->qnext)
+    if (b->dev > q->dev || (b->dev == q->dev && b->blockno >= q->blockno))
+      return b;
+  return q->sorted[d];
+}
+
+static struct buf *elevator_pick(struct ioqueue *q) {
+  if (q->sorted[IOQ_READ])
+    return clook(q, IOQ_READ);
+  return clook(q, IOQ_WRITE);
+}
+
+static struct buf *deadline_pick(struct ioqueue *q) {
+  struct buf *r = q->fifo[IOQ_READ];
+  struct buf *w = q->fifo[IOQ_WRITE];
+
+  if (r && ticks - r->qtime >= READ_EXPIRE)
+    return r;
+  if (w && ticks - w->qtime >= WRITE_EXPIRE)
+    return w;
+  return elevator_pick(q);
+}
+
+struct iosched iosched_elevator = {
+  .name = "elevator",
+  .pick = elevator_pick,
+};
+
+struct iosched iosched_deadline = {
+  .name = "deadline",
+  .pick = deadline_pick,
+};
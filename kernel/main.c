@@ -28,6 +28,7 @@ int main(uint64_t addr) {
   binit();    // buffer cache
   ideinit();  // disk
   userinit(); // first user process
+  bprefetchinit(); // readahead thread
   mpmain();
   return 0;
 }
@@ -0,0 +1,91 @@
+// PCI configuration space access through the legacy
+// 0xcf8/0xcfc ports, and a scan of bus 0 for drivers that
+// want to find their device.
+// https://wiki.osdev.org/PCI
+
+#include <cdefs.h>
+#include <defs.h>
+#include <pci.h>
+#include <x86_64.h>
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+#define PCI_NDEV 32
+#define PCI_NFUNC 8
+
+static void pciconfaddr(struct pcifunc *f, uint off) {
+  outl(PCI_CONFIG_ADDR, (1 << 31) | (f->bus << 16) | (f->dev << 11) |
+                            (f->func << 8) | (off & 0xfc));
+}
+
+uint pciconfread(struct pcifunc *f, uint off) {
+  pciconfaddr(f, off);
+  return inl(PCI_CONFIG_DATA);
+}
+
+void pciconfwrite(struct pcifunc *f, uint off, uint v) {
+  pciconfaddr(f, off);
+  outl(PCI_CONFIG_DATA, v);
+}
+
+// Turn on the command register bits in flags.
+void pcienable(struct pcifunc *f, uint flags) {
+  uint v = pciconfread(f, PCI_CONF_COMMAND);
+  pciconfwrite(f, PCI_CONF_COMMAND, v | flags);
+}
+
+// Fill in *f for the function at bus 0, dev, func.
+// Returns -1 if nothing is there.
+static int pciprobe(uint dev, uint func, struct pcifunc *f) {
+  uint id, class, i;
+
+  f->bus = 0;
+  f->dev = dev;
+  f->func = func;
+  id = pciconfread(f, 0x00);
+  if ((id & 0xffff) == 0xffff)
+    return -1;
+
+  f->vendor = id & 0xffff;
+  f->device = id >> 16;
+  class = pciconfread(f, 0x08);
+  f->class = class >> 24;
+  f->subclass = (class >> 16) & 0xff;
+  f->progif = (class >> 8) & 0xff;
+  f->irq = pciconfread(f, PCI_CONF_INTR) & 0xff;
+  for (i = 0; i < 6; i++)
+    f->bar[i] = pciconfread(f, PCI_CONF_BAR0 + 4 * i);
+  return 0;
+}
+
+// Find the first function on bus 0 with the given vendor and
+// device ids, or (if vendor is 0) the given class and subclass.
+// Returns 0 and fills in *f if found, -1 if not.
+static int pcifind(ushort vendor, ushort device, uchar class, uchar subclass,
+                   struct pcifunc *f) {
+  uint dev, func;
+
+  for (dev = 0; dev < PCI_NDEV; dev++) {
+    for (func = 0; func < PCI_NFUNC; func++) {
+      if (pciprobe(dev, func, f) < 0) {
+        if (func == 0)
+          break;
+        continue;
+      }
+      if (vendor != 0 && f->vendor == vendor && f->device == device)
+        return 0;
+      if (vendor == 0 && f->class == class && f->subclass == subclass)
+        return 0;
+    }
+  }
+  return -1;
+}
+
+int pcifinddev(ushort vendor, ushort device, struct pcifunc *f) {
+  return pcifind(vendor, device, 0, 0, f);
+}
+
+int pcifindclass(uchar class, uchar subclass, struct pcifunc *f) {
+  return pcifind(0, 0, class, subclass, f);
+}
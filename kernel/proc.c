@@ -23,6 +23,7 @@ static struct proc *initproc;
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
+static void kthreadret(void);
 
 static void wakeup1(void *chan);
 
@@ -118,6 +119,33 @@ void userinit(void) {
   release(&ptable.lock);
 }
 
+// Start a kernel thread that runs fn.  Kernel threads get an
+// address space with only the kernel mapped and never return to
+// user mode.  fn must not return.
+// Returns the pid of the thread, or -1 on failure.
+int kthread_create(char *name, void (*fn)(void)) {
+  struct proc *p;
+
+  if ((p = allocproc()) == 0)
+    return -1;
+
+  if (vspaceinit(&p->vspace) < 0) {
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return -1;
+  }
+  p->context->rip = (uint64_t)kthreadret;
+  p->kentry = fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+
+  return p->pid;
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
@@ -358,6 +386,16 @@ void forkret(void) {
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch here.
+static void kthreadret(void) {
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+
+  myproc()->kentry();
+  panic("kthreadret: kernel thread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk) {
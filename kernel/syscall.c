@@ -165,6 +165,8 @@ extern int sys_uptime(void);
 extern int sys_sysinfo(void);
 extern int sys_crashn(void);
 extern int sys_unlink(void);
+extern int sys_lseek(void);
+extern int sys_sync(void);
 
 static int (*syscalls[])(void) = {
     [SYS_fork] = sys_fork,       [SYS_exit] = sys_exit,
@@ -176,7 +178,8 @@ static int (*syscalls[])(void) = {
     [SYS_uptime] = sys_uptime,   [SYS_open] = sys_open,
     [SYS_write] = sys_write,     [SYS_close] = sys_close,
     [SYS_sysinfo] = sys_sysinfo, [SYS_crashn] = sys_crashn,
-    [SYS_unlink] = sys_unlink,
+    [SYS_unlink] = sys_unlink,   [SYS_lseek] = sys_lseek,
+    [SYS_sync] = sys_sync,
 };
 
 void syscall(void) {
@@ -202,6 +205,17 @@ int sys_sysinfo(void) {
   info->free_pages = free_pages;
   info->num_page_faults = num_page_faults;
   info->num_disk_reads = num_disk_reads;
+  info->num_bcache_hits = num_bcache_hits;
+  info->num_bcache_misses = num_bcache_misses;
+  info->num_bcache_evictions = num_bcache_evictions;
+  info->num_dirty_writebacks = num_dirty_writebacks;
+  info->num_disk_cmds = num_disk_cmds;
+  info->num_disk_sectors = num_disk_sectors;
+  info->io_wait_ticks = io_wait_ticks;
+  info->num_icache_hits = num_icache_hits;
+  info->num_icache_misses = num_icache_misses;
+  info->num_dcache_hits = num_dcache_hits;
+  info->num_dcache_misses = num_dcache_misses;
 
   return 0;
 }
@@ -355,3 +355,44 @@ int sys_unlink(void) {
 
   return file_unlink(path);
 }
+
+/*
+ * arg0: int [file descriptor]
+ * arg1: int [offset]
+ * arg2: int [whence: SEEK_SET, SEEK_CUR or SEEK_END (see inc/fcntl.h)]
+ *
+ * Move the current position of the file to arg1 bytes from the start
+ * of the file, the current position or the end of the file.  The
+ * position may go past the end of the file; a write there leaves a
+ * hole, which reads as zeros and takes no disk space.
+ *
+ * Return the new position, or -1 if there was an error.
+ *
+ * Errors:
+ * arg0 is not an open file descriptor
+ * arg0 is a pipe or a device
+ * arg2 is not a valid whence
+ * the new position would be negative
+ */
+int sys_lseek(void) {
+  int fd;
+  int offset;
+  int whence;
+
+  if (argfd(0, &fd) < 0 || argint(1, &offset) < 0 || argint(2, &whence) < 0) {
+    return -1;
+  }
+
+  return file_lseek(fd, offset, whence);
+}
+
+/*
+ * Write every committed transaction to its home blocks now rather
+ * than at the next checkpoint, leaving the log empty.
+ *
+ * Returns 0.
+ */
+int sys_sync(void) {
+  log_sync();
+  return 0;
+}
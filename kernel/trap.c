@@ -74,6 +74,13 @@ void trap(struct trap_frame *tf) {
     break;
 
   default:
+    // A disk driver other than ide.c may get another line.
+    if (tf->trapno == TRAP_IRQ0 + ideirq) {
+      ideintr();
+      lapiceoi();
+      break;
+    }
+
     addr = rcr2();
 
     if (tf->trapno == TRAP_PF) {
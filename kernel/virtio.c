@@ -0,0 +1,320 @@
+// virtio-blk driver, using the legacy PCI interface of QEMU's
+// virtio-blk-pci device.  A drop-in replacement for ide.c:
+// build with DISK=virtio (see kernel/Makefrag) and the root
+// disk is served by this driver instead.
+//
+// Unlike IDE, the device accepts many requests at once.  Pending
+// bufs wait in an ioqueue like ide.c's; whenever descriptors are
+// free, the scheduler's next pick (merged with the bufs for the
+// blocks right after it) becomes one request on the virtqueue.
+// The interrupt handler completes whatever the device has put on
+// the used ring and refills the virtqueue.
+// https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.html
+
+#include <cdefs.h>
+#include <defs.h>
+#include <fs.h>
+#include <iosched.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <pci.h>
+#include <proc.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+#include <trap.h>
+#include <x86_64.h>
+
+#include <buf.h>
+
+#define SECTOR_SIZE 512
+
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_DEVICE_BLK 0x1001 // transitional virtio-blk
+
+// Legacy I/O registers, relative to BAR0.
+#define VIRTIO_HOST_FEATURES 0x00
+#define VIRTIO_GUEST_FEATURES 0x04
+#define VIRTIO_QUEUE_PFN 0x08
+#define VIRTIO_QUEUE_SIZE 0x0c
+#define VIRTIO_QUEUE_SEL 0x0e
+#define VIRTIO_QUEUE_NOTIFY 0x10
+#define VIRTIO_STATUS 0x12
+#define VIRTIO_ISR 0x13
+
+#define VIRTIO_STATUS_ACK 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+
+#define VIRTQ_DESC_F_NEXT 0x1
+#define VIRTQ_DESC_F_WRITE 0x2 // device writes (vs reads) the buffer
+
+#define VIRTIO_BLK_T_IN 0  // read
+#define VIRTIO_BLK_T_OUT 1 // write
+
+#define VIRTQ_MAX 256     // largest queue we have room for
+#define VIRTIO_MAXBUFS 32 // bufs merged into one request
+
+struct virtq_desc {
+  uint64_t addr;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+
+struct virtq_avail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct virtq_used_elem {
+  uint id; // head descriptor of the finished request
+  uint len;
+};
+
+struct virtq_used {
+  ushort flags;
+  ushort idx;
+  struct virtq_used_elem ring[];
+};
+
+// Header descriptor of every request.
+struct virtio_blk_req {
+  uint type;
+  uint reserved;
+  uint64_t sector;
+};
+
+int ideirq = IRQ_IDE;
+
+// The legacy interface wants the rings in physically contiguous,
+// page aligned memory: descriptors and available ring first, used
+// ring on the next page boundary.  Three pages fit VIRTQ_MAX.
+static uchar vqmem[3 * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static struct {
+  struct spinlock lock;
+  ushort iobase;
+  uint qsize;
+
+  struct virtq_desc *desc;
+  volatile struct virtq_avail *avail;
+  volatile struct virtq_used *used;
+  ushort usedidx; // used ring entries handled so far
+
+  ushort freedesc; // free descriptors, linked by next
+  uint nfree;
+
+  struct ioqueue queue; // bufs not on the virtqueue yet
+
+  // Per request, indexed by its head descriptor.
+  struct virtio_blk_req hdr[VIRTQ_MAX];
+  uchar status[VIRTQ_MAX];
+  struct buf *bufs[VIRTQ_MAX]; // linked by qnext
+} vdisk;
+
+static ushort allocdesc(void) {
+  ushort d = vdisk.freedesc;
+
+  vdisk.freedesc = vdisk.desc[d].next;
+  vdisk.nfree--;
+  return d;
+}
+
+// Free the descriptor chain starting at d.
+static void freechain(ushort d) {
+  int more;
+
+  do {
+    more = vdisk.desc[d].flags & VIRTQ_DESC_F_NEXT;
+    ushort next = vdisk.desc[d].next;
+    vdisk.desc[d].next = vdisk.freedesc;
+    vdisk.freedesc = d;
+    vdisk.nfree++;
+    d = next;
+  } while (more);
+}
+
+void ideinit(void) {
+  struct pcifunc f;
+  uint i, usedoff;
+
+  initlock(&vdisk.lock, "virtio");
+  ioqinit(&vdisk.queue, &IOSCHED);
+
+  if (pcifinddev(VIRTIO_VENDOR, VIRTIO_DEVICE_BLK, &f) < 0 ||
+      !(f.bar[0] & PCI_BAR_IO))
+    panic("virtio: no block device");
+  pcienable(&f, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+  vdisk.iobase = PCI_BAR_IOADDR(f.bar[0]);
+
+  // Reset, say hello, and take none of the optional features.
+  outb(vdisk.iobase + VIRTIO_STATUS, 0);
+  outb(vdisk.iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+  outb(vdisk.iobase + VIRTIO_STATUS,
+       VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+  inl(vdisk.iobase + VIRTIO_HOST_FEATURES);
+  outl(vdisk.iobase + VIRTIO_GUEST_FEATURES, 0);
+
+  // Set up queue 0, the only one.
+  outw(vdisk.iobase + VIRTIO_QUEUE_SEL, 0);
+  vdisk.qsize = inw(vdisk.iobase + VIRTIO_QUEUE_SIZE);
+  if (vdisk.qsize < VIRTIO_MAXBUFS + 2 || vdisk.qsize > VIRTQ_MAX)
+    panic("virtio: bad queue size");
+  usedoff = PGROUNDUP(sizeof(struct virtq_desc) * vdisk.qsize +
+                      sizeof(struct virtq_avail) + 2 * vdisk.qsize + 2);
+  if (usedoff + sizeof(struct virtq_used) +
+          sizeof(struct virtq_used_elem) * vdisk.qsize + 2 >
+      sizeof(vqmem))
+    panic("virtio: queue too big");
+
+  memset(vqmem, 0, sizeof(vqmem));
+  vdisk.desc = (struct virtq_desc *)vqmem;
+  vdisk.avail = (struct virtq_avail *)(vqmem + sizeof(struct virtq_desc) *
+                                                   vdisk.qsize);
+  vdisk.used = (struct virtq_used *)(vqmem + usedoff);
+  for (i = 0; i < vdisk.qsize; i++)
+    vdisk.desc[i].next = i + 1;
+  vdisk.freedesc = 0;
+  vdisk.nfree = vdisk.qsize;
+  outl(vdisk.iobase + VIRTIO_QUEUE_PFN, V2P(vqmem) >> PT_SHIFT);
+
+  outb(vdisk.iobase + VIRTIO_STATUS, VIRTIO_STATUS_ACK |
+                                         VIRTIO_STATUS_DRIVER |
+                                         VIRTIO_STATUS_DRIVER_OK);
+
+  ideirq = f.irq;
+  picenable(ideirq);
+  ioapicenable(ideirq, ncpu - 1);
+}
+
+// Put the request for the bufs in chain b on the available ring.
+// Caller must hold vdisk.lock and make sure enough descriptors
+// are free.
+static void vdiskpost(struct buf *b) {
+  struct buf *p;
+  ushort head, d, prev;
+  int write = (b->flags & B_DIRTY) != 0;
+
+  head = allocdesc();
+  vdisk.hdr[head].type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  vdisk.hdr[head].reserved = 0;
+  vdisk.hdr[head].sector = (uint64_t)b->blockno * (BSIZE / SECTOR_SIZE);
+  vdisk.desc[head].addr = V2P(&vdisk.hdr[head]);
+  vdisk.desc[head].len = sizeof(struct virtio_blk_req);
+  vdisk.desc[head].flags = VIRTQ_DESC_F_NEXT;
+  prev = head;
+
+  num_disk_cmds++;
+  for (p = b; p != 0; p = p->qnext) {
+    num_disk_sectors += BSIZE / SECTOR_SIZE;
+    d = allocdesc();
+    vdisk.desc[d].addr = V2P(p->data);
+    vdisk.desc[d].len = BSIZE;
+    vdisk.desc[d].flags = VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE);
+    vdisk.desc[prev].next = d;
+    prev = d;
+  }
+
+  d = allocdesc();
+  vdisk.status[head] = 0xff;
+  vdisk.desc[d].addr = V2P(&vdisk.status[head]);
+  vdisk.desc[d].len = 1;
+  vdisk.desc[d].flags = VIRTQ_DESC_F_WRITE;
+  vdisk.desc[prev].next = d;
+
+  vdisk.bufs[head] = b;
+  vdisk.avail->ring[vdisk.avail->idx % vdisk.qsize] = head;
+  __sync_synchronize();
+  vdisk.avail->idx++;
+}
+
+// Move as many pending bufs onto the virtqueue as there are free
+// descriptors for, and tell the device.  Caller must hold vdisk.lock.
+static void vdiskstart(void) {
+  struct buf *b;
+  int posted = 0;
+
+  while (vdisk.nfree >= VIRTIO_MAXBUFS + 2 &&
+         (b = ioqnext(&vdisk.queue, VIRTIO_MAXBUFS)) != 0) {
+    vdiskpost(b);
+    posted = 1;
+  }
+  if (posted) {
+    __sync_synchronize();
+    outw(vdisk.iobase + VIRTIO_QUEUE_NOTIFY, 0);
+  }
+}
+
+// Interrupt handler.
+void ideintr(void) {
+  struct buf *b;
+  ushort head;
+
+  acquire(&vdisk.lock);
+
+  // Reading the ISR acknowledges the interrupt.
+  inb(vdisk.iobase + VIRTIO_ISR);
+
+  while (vdisk.usedidx != vdisk.used->idx) {
+    __sync_synchronize();
+    head = vdisk.used->ring[vdisk.usedidx % vdisk.qsize].id;
+    if (vdisk.status[head] != 0)
+      panic("virtio: request failed");
+
+    // Wake processes waiting for the bufs of this request.
+    for (b = vdisk.bufs[head]; b != 0; b = b->qnext) {
+      b->flags |= B_VALID;
+      b->flags &= ~B_DIRTY;
+      wakeup(b);
+    }
+    vdisk.bufs[head] = 0;
+    freechain(head);
+    vdisk.usedidx++;
+  }
+
+  vdiskstart();
+
+  release(&vdisk.lock);
+}
+
+// Queue b for the disk and return without waiting for it.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// b must stay locked until iderw_wait(b) returns.
+void iderw_submit(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("iderw: buf not locked");
+  if ((b->flags & (B_VALID | B_DIRTY)) == B_VALID)
+    panic("iderw: nothing to do");
+  if (b->dev != ROOTDEV)
+    panic("iderw: no such virtio disk");
+
+  acquire(&vdisk.lock);
+  ioqadd(&vdisk.queue, b);
+  vdiskstart();
+  release(&vdisk.lock);
+}
+
+// Wait for the request submitted for b to finish.
+// Returns right away if b has nothing pending.
+void iderw_wait(struct buf *b) {
+  if (!holdingsleep(&b->lock))
+    panic("iderw_wait: buf not locked");
+
+  acquire(&vdisk.lock);
+  while ((b->flags & (B_VALID | B_DIRTY)) != B_VALID) {
+    sleep(b, &vdisk.lock);
+  }
+  release(&vdisk.lock);
+}
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void iderw(struct buf *b) {
+  iderw_submit(b);
+  iderw_wait(b);
+}
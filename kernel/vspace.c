@@ -140,6 +140,7 @@ vrloaddata(struct vregion *r, uint64_t va, struct inode *ip, uint offset, uint s
 {
   uint i, n;
   struct vpage_info *vpi;
+  struct readahead ra = { .next = offset };
   assertm(va % PGSIZE == 0, "va must be page aligned");
 
   for (i = 0; i < sz; i += PGSIZE) {
@@ -148,6 +149,7 @@ vrloaddata(struct vregion *r, uint64_t va, struct inode *ip, uint offset, uint s
     n = min(sz - i, (uint) PGSIZE);
     if (readi(ip, P2V(vpi->ppn << PT_SHIFT), offset + i, n) != n)
       return -1;
+    readahead(ip, &ra, offset + i, n);
   }
 
   return 0;
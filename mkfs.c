@@ -19,14 +19,13 @@ typedef unsigned char  uchar;
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define IPB (BSIZE / sizeof(struct dinode))
 #define CONSOLE 1
 
 // Disk layout:
-// [ boot block | sb block | free bit map | log | inode file start | data blocks ]
+// [ boot block | sb block | free bit map | log header | log | inode file start | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nmeta;    // Number of meta blocks (boot, sb, bitmap, log header, nlog)
 int nblocks;  // Number of data blocks
 int nlogblocks = LOGSIZE;
 
@@ -85,8 +84,24 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 3 && strcmp(argv[1], "-l") == 0){
+    nlogblocks = atoi(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+
+  // The kernel pins every block in the log in its buffer cache
+  // until checkpoint, so it uses at most its cache size less
+  // LOGBATCH + MAXOPBLOCKS buffers of the log (about 160 blocks
+  // with a 16M machine and 4K blocks), however big it is made.
+  if(nlogblocks < MAXOPBLOCKS || nlogblocks > MAXLOGSIZE){
+    fprintf(stderr, "mkfs: log size must be between %d and %d blocks\n",
+            MAXOPBLOCKS, (int)MAXLOGSIZE);
     exit(1);
   }
 
@@ -99,18 +114,20 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
-  nmeta = 2 + nbitmap + nlogblocks;
+  // 1 fs block = BSIZE / 512 disk sectors
+  nmeta = 2 + nbitmap + 1 + nlogblocks;
   nblocks = FSSIZE - nmeta;
 
   sb.size = xint(FSSIZE);
   sb.nblocks = xint(nblocks);
   sb.bmapstart = xint(2);
   sb.logstart = xint(2 + nbitmap);
-  sb.inodestart = xint(2+nlogblocks+nbitmap);
+  sb.inodestart = xint(2+nbitmap+1+nlogblocks);
+  sb.bsize = xint(BSIZE);
+  sb.nlog = xint(nlogblocks);
 
-  printf("nmeta %d (boot, super, bitmap blocks %u) blocks %d total %d\n",
-       nmeta, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, bitmap blocks %u) blocks %d total %d bsize %d\n",
+       nmeta, nbitmap, nblocks, FSSIZE, BSIZE);
   freeblock = nmeta;     // the first free block that we can allocate
 
   for(i = 0; i < FSSIZE; i++)
@@ -0,0 +1,396 @@
+#include <cdefs.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <param.h>
+#include <stat.h>
+#include <user.h>
+#include <test.h>
+
+void run_test(char*);
+void lseek_hole(void);
+void big_dir(void);
+void fragmented_file(void);
+void big_write(void);
+
+char buf[8192];
+
+int main(int argc, char *argv[]) {
+  char cmd[40];
+
+  while (true) {
+    shell_prompt("fstest");
+    memset(cmd, 0, sizeof(cmd));
+    gets(cmd, sizeof(cmd));
+    if (cmd[0] == 0) {
+      continue;
+    }
+    run_test(cmd);
+  }
+
+  exit();
+  return 0;
+}
+
+void run_test(char* test) {
+  if (strcmp(test, "all\n") == 0) {
+    lseek_hole();
+    big_dir();
+    fragmented_file();
+    big_write();
+    pass("fstest tests");
+  } else if (strcmp(test, "exit\n") == 0) {
+    exit();
+  } else if (strcmp(test, "lseek_hole\n") == 0) {
+    lseek_hole();
+  } else if (strcmp(test, "big_dir\n") == 0) {
+    big_dir();
+  } else if (strcmp(test, "fragmented_file\n") == 0) {
+    fragmented_file();
+  } else if (strcmp(test, "big_write\n") == 0) {
+    big_write();
+  } else {
+    printf(stderr, "input matches no test: %s" , test);
+  }
+}
+
+// seek past the end of a file and write there
+// the bytes in between must read as zeros
+void lseek_hole(void) {
+  test("lseek_hole");
+
+  int fd, i, n, off, size;
+  struct stat st;
+
+  off = 3 * BSIZE + 100;
+  size = off + 10;
+
+  unlink("lseek_hole.txt");
+  if ((fd = open("lseek_hole.txt", O_CREATE | O_RDWR)) < 0) {
+    error("lseek_hole: create 'lseek_hole.txt' failed");
+  }
+
+  memset(buf, 'a', 10);
+  assert(write(fd, buf, 10) == 10);
+  if ((n = lseek(fd, off, SEEK_SET)) != off) {
+    error("lseek_hole: lseek to %d past the end returned %d", off, n);
+  }
+  memset(buf, 'b', 10);
+  assert(write(fd, buf, 10) == 10);
+
+  assert(fstat(fd, &st) == 0);
+  if (st.size != size) {
+    error("lseek_hole: size after writing past the end is %d, expected %d", st.size, size);
+  }
+  if ((n = lseek(fd, 0, SEEK_END)) != size) {
+    error("lseek_hole: lseek to the end returned %d, expected %d", n, size);
+  }
+
+  // bad seeks fail and leave the position alone
+  if (lseek(fd, -1, SEEK_SET) != -1) {
+    error("lseek_hole: lseek to a negative offset did not fail");
+  }
+  if (lseek(fd, -(size + 1), SEEK_END) != -1) {
+    error("lseek_hole: lseek to before the start of the file did not fail");
+  }
+  if (lseek(fd, 0, 3) != -1) {
+    error("lseek_hole: lseek with a bad whence did not fail");
+  }
+  if ((n = lseek(fd, 0, SEEK_CUR)) != size) {
+    error("lseek_hole: a failed lseek moved the position to %d", n);
+  }
+  assert(close(fd) == 0);
+
+  // read it back through a fresh descriptor
+  if ((fd = open("lseek_hole.txt", O_RDONLY)) < 0) {
+    error("lseek_hole: failed to reopen 'lseek_hole.txt'");
+  }
+  for (i = 0; i < size; i += n) {
+    if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+      error("lseek_hole: read at %d returned %d", i, n);
+    }
+    for (int j = 0; j < n; j++) {
+      char want = i + j < 10 ? 'a' : i + j < off ? 0 : 'b';
+      if (buf[j] != want) {
+        error("lseek_hole: byte %d is %d, expected %d", i + j, buf[j], want);
+      }
+    }
+  }
+  assert(read(fd, buf, sizeof(buf)) == 0);
+  assert(close(fd) == 0);
+
+  if (unlink("lseek_hole.txt") < 0) {
+    error("lseek_hole: failed to unlink 'lseek_hole.txt'");
+  }
+
+  pass("");
+}
+
+#define NDIRFILES 400
+
+// return the two-letter prefix followed by i as three digits
+static char *numname(char *prefix, int i) {
+  static char name[6];
+
+  name[0] = prefix[0];
+  name[1] = prefix[1];
+  name[2] = '0' + i / 100;
+  name[3] = '0' + i / 10 % 10;
+  name[4] = '0' + i % 10;
+  name[5] = 0;
+  return name;
+}
+
+// read the root directory as dirents, like ls does, and count the
+// big_dir files in it; seen[i] is set for each one found
+static int dxreaddir(char *seen) {
+  struct dirent de;
+  int fd, i, n = 0;
+
+  memset(seen, 0, NDIRFILES);
+  if ((fd = open("/", O_RDONLY)) < 0) {
+    error("big_dir: failed to open the root directory");
+  }
+  while (read(fd, &de, sizeof(de)) == sizeof(de)) {
+    if (de.inum == 0 || de.name[0] != 'd' || de.name[1] != 'x')
+      continue;
+    i = atoi(de.name + 2);
+    if (i < 0 || i >= NDIRFILES || strcmp(de.name, numname("dx", i)) != 0) {
+      error("big_dir: unexpected entry '%s'", de.name);
+    }
+    if (seen[i]) {
+      error("big_dir: '%s' is listed twice", de.name);
+    }
+    seen[i] = 1;
+    n++;
+  }
+  assert(close(fd) == 0);
+  return n;
+}
+
+// create enough files in one directory that it gets a hash index
+// and splits a leaf, then look them up, list them and unlink them
+void big_dir(void) {
+  test("big_dir");
+
+  int fd, i, v;
+  char seen[NDIRFILES];
+  struct stat st;
+
+  for (i = 0; i < NDIRFILES; i++) {
+    unlink(numname("dx", i));
+    if ((fd = open(numname("dx", i), O_CREATE | O_RDWR)) < 0) {
+      error("big_dir: create '%s' failed", numname("dx", i));
+    }
+    assert(write(fd, &i, sizeof(i)) == sizeof(i));
+    assert(close(fd) == 0);
+  }
+
+  // an index block and at least two leaves
+  assert(stat("/", &st) == 0);
+  if (st.size < 3 * BSIZE) {
+    error("big_dir: root directory is %d bytes, too small to have split", st.size);
+  }
+
+  for (i = 0; i < NDIRFILES; i++) {
+    if ((fd = open(numname("dx", i), O_RDONLY)) < 0) {
+      error("big_dir: lookup of '%s' failed", numname("dx", i));
+    }
+    if (read(fd, &v, sizeof(v)) != sizeof(v) || v != i) {
+      error("big_dir: '%s' holds the wrong file", numname("dx", i));
+    }
+    assert(close(fd) == 0);
+  }
+  if ((i = dxreaddir(seen)) != NDIRFILES) {
+    error("big_dir: listed %d files, expected %d", i, NDIRFILES);
+  }
+
+  // unlink every other file
+  for (i = 0; i < NDIRFILES; i += 2) {
+    if (unlink(numname("dx", i)) < 0) {
+      error("big_dir: unlink '%s' failed", numname("dx", i));
+    }
+  }
+  for (i = 0; i < NDIRFILES; i++) {
+    fd = open(numname("dx", i), O_RDONLY);
+    if (i % 2 == 0 && fd >= 0) {
+      error("big_dir: found '%s' after unlinking it", numname("dx", i));
+    }
+    if (i % 2 == 1 && fd < 0) {
+      error("big_dir: lookup of '%s' failed after unlinking its neighbors", numname("dx", i));
+    }
+    if (fd >= 0) {
+      assert(close(fd) == 0);
+    }
+  }
+  if ((i = dxreaddir(seen)) != NDIRFILES / 2) {
+    error("big_dir: listed %d files after unlinking half, expected %d", i, NDIRFILES / 2);
+  }
+  for (i = 0; i < NDIRFILES; i++) {
+    if (seen[i] != i % 2) {
+      error("big_dir: '%s' is %s", numname("dx", i), seen[i] ? "still listed" : "missing");
+    }
+  }
+
+  for (i = 1; i < NDIRFILES; i += 2) {
+    if (unlink(numname("dx", i)) < 0) {
+      error("big_dir: unlink '%s' failed", numname("dx", i));
+    }
+  }
+  if ((i = dxreaddir(seen)) != 0) {
+    error("big_dir: listed %d files after unlinking them all", i);
+  }
+
+  pass("");
+}
+
+#define NFRAG 48
+
+// fill block i of the fragmented file with i + 1
+static void fragwrite(int fd, int i) {
+  memset(buf, i + 1, BSIZE);
+  if (lseek(fd, i * BSIZE, SEEK_SET) != i * BSIZE || write(fd, buf, BSIZE) != BSIZE) {
+    error("fragmented_file: failed to write block %d", i);
+  }
+}
+
+static void fragcheck(int nblocks) {
+  int fd, i, j;
+  struct stat st;
+
+  if ((fd = open("frag.txt", O_RDONLY)) < 0) {
+    error("fragmented_file: failed to open 'frag.txt'");
+  }
+  assert(fstat(fd, &st) == 0);
+  if (st.size != nblocks * BSIZE) {
+    error("fragmented_file: size is %d, expected %d", st.size, nblocks * BSIZE);
+  }
+  for (i = 0; i < nblocks; i++) {
+    if (read(fd, buf, BSIZE) != BSIZE) {
+      error("fragmented_file: failed to read block %d", i);
+    }
+    for (j = 0; j < BSIZE; j++) {
+      if (buf[j] != (char)(i + 1)) {
+        error("fragmented_file: byte %d of block %d is %d, expected %d", j, i, buf[j], i + 1);
+      }
+    }
+  }
+  assert(read(fd, buf, BSIZE) == 0);
+  assert(close(fd) == 0);
+}
+
+// punch one-block holes all over the disk, then write a file a
+// block at a time into them, so that it has more extents than fit
+// in its dinode; read it back, trim it and unlink it
+void fragmented_file(void) {
+  test("fragmented_file");
+
+  int fd, i;
+
+  // Filler files take the lowest free blocks one at a time.
+  // Removing every other one leaves single free blocks between
+  // the rest.
+  memset(buf, 0, BSIZE);
+  for (i = 0; i < 2 * NFRAG; i++) {
+    unlink(numname("fr", i));
+    if ((fd = open(numname("fr", i), O_CREATE | O_RDWR)) < 0) {
+      error("fragmented_file: create '%s' failed", numname("fr", i));
+    }
+    assert(write(fd, buf, BSIZE) == BSIZE);
+    assert(close(fd) == 0);
+  }
+  for (i = 0; i < 2 * NFRAG; i += 2) {
+    assert(unlink(numname("fr", i)) == 0);
+  }
+
+  // Writing the last block first makes the rest a hole.  Each
+  // block written into it cannot grow the extent before it, so it
+  // gets the next free block: one of the holes punched above.
+  unlink("frag.txt");
+  if ((fd = open("frag.txt", O_CREATE | O_RDWR)) < 0) {
+    error("fragmented_file: create 'frag.txt' failed");
+  }
+  fragwrite(fd, NFRAG - 1);
+  for (i = 0; i < NFRAG - 1; i++) {
+    fragwrite(fd, i);
+  }
+  assert(close(fd) == 0);
+  fragcheck(NFRAG);
+
+  // An append preallocates blocks past the end, and closing the
+  // file frees them again from the end of the extent tree.
+  if ((fd = open("frag.txt", O_RDWR)) < 0) {
+    error("fragmented_file: failed to reopen 'frag.txt'");
+  }
+  fragwrite(fd, NFRAG);
+  assert(close(fd) == 0);
+  fragcheck(NFRAG + 1);
+
+  if (unlink("frag.txt") < 0) {
+    error("fragmented_file: failed to unlink 'frag.txt'");
+  }
+  if ((fd = open("frag.txt", O_RDONLY)) >= 0) {
+    error("fragmented_file: opened 'frag.txt' after unlinking it");
+  }
+  for (i = 1; i < 2 * NFRAG; i += 2) {
+    assert(unlink(numname("fr", i)) == 0);
+  }
+
+  pass("");
+}
+
+#define BIGWRITE (4 * 1024 * 1024)
+
+// write several megabytes in one call, far more than the log holds,
+// so the kernel has to split it into many operations
+void big_write(void) {
+  test("big_write");
+
+  int fd, i, n;
+  char *p;
+  struct stat st;
+
+  if ((p = malloc(BIGWRITE)) == 0) {
+    error("big_write: failed to allocate %d bytes", BIGWRITE);
+  }
+  // 251 does not divide BSIZE, so neighboring blocks differ
+  for (i = 0; i < BIGWRITE; i++) {
+    p[i] = i % 251;
+  }
+
+  unlink("big_write.txt");
+  if ((fd = open("big_write.txt", O_CREATE | O_RDWR)) < 0) {
+    error("big_write: create 'big_write.txt' failed");
+  }
+  if ((n = write(fd, p, BIGWRITE)) != BIGWRITE) {
+    error("big_write: wrote %d bytes, expected %d", n, BIGWRITE);
+  }
+  assert(fstat(fd, &st) == 0);
+  if (st.size != BIGWRITE) {
+    error("big_write: size is %d, expected %d", st.size, BIGWRITE);
+  }
+  assert(close(fd) == 0);
+
+  if ((fd = open("big_write.txt", O_RDONLY)) < 0) {
+    error("big_write: failed to reopen 'big_write.txt'");
+  }
+  memset(p, 0, BIGWRITE);
+  for (i = 0; i < BIGWRITE; i += n) {
+    if ((n = read(fd, p + i, BIGWRITE - i)) <= 0) {
+      error("big_write: read at %d returned %d", i, n);
+    }
+  }
+  assert(read(fd, buf, 1) == 0);
+  assert(close(fd) == 0);
+  for (i = 0; i < BIGWRITE; i++) {
+    if (p[i] != (char)(i % 251)) {
+      error("big_write: byte %d is %d, expected %d", i, p[i], i % 251);
+    }
+  }
+  free(p);
+
+  if (unlink("big_write.txt") < 0) {
+    error("big_write: failed to unlink 'big_write.txt'");
+  }
+
+  pass("");
+}
@@ -10,9 +10,9 @@
 
 char buf[8192];
 char* file_name = "newfile.txt";
-int ROOT_DIR_START_SIZE = 400;
+int ROOT_DIR_START_SIZE = 432;
 int DIRENT_SIZE = 16;
-int INUM_START = 24;
+int INUM_START = 26;
 
 void create_file(int);
 void check_system_consistent(bool*);
@@ -0,0 +1,52 @@
+// Leave a log of a given fill behind for the next boot to recover.
+//
+//   logfill nblocks
+//
+// Empties the log with sync, then writes nblocks blocks to a file,
+// which commits them to the log, then crashes (see SYS_crashn) at
+// the first disk write of the next transaction, before the log is
+// checkpointed.  The next boot prints how long recovery took;
+// crash_safety_test.py --recovery runs this for several fills.
+
+#include <cdefs.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <stat.h>
+#include <user.h>
+
+char *file_name = "logfill.out";
+
+int main(int argc, char *argv[]) {
+  int fd, n;
+  char *buf;
+
+  if (argc != 2 || (n = atoi(argv[1])) < 0) {
+    printf(2, "usage: logfill nblocks\n");
+    exit();
+  }
+  if ((buf = malloc(n * BSIZE + 1)) == 0) {
+    printf(2, "logfill: out of memory\n");
+    exit();
+  }
+  memset(buf, 'l', n * BSIZE + 1);
+
+  unlink(file_name);
+  if ((fd = open(file_name, O_CREATE | O_RDWR)) < 0) {
+    printf(2, "logfill: cannot create %s\n", file_name);
+    exit();
+  }
+  // Checkpoint the create (and anything before it) so the log
+  // holds only this write when we crash.
+  sync();
+  if (write(fd, buf, n * BSIZE) != n * BSIZE) {
+    printf(2, "logfill: write failed\n");
+    exit();
+  }
+
+  printf(1, "logfill: %d blocks written, crashing\n", n);
+  crashn(0);
+  write(fd, buf, 1);
+
+  printf(2, "logfill: did not crash\n");
+  exit();
+}
@@ -13,6 +13,17 @@ int main(int argc, char *argv[]) {
   printf(1, "free_pages = %d\n", info.free_pages);
   printf(1, "num_page_faults = %d\n", info.num_page_faults);
   printf(1, "num_disk_reads = %d\n", info.num_disk_reads);
+  printf(1, "num_bcache_hits = %d\n", info.num_bcache_hits);
+  printf(1, "num_bcache_misses = %d\n", info.num_bcache_misses);
+  printf(1, "num_bcache_evictions = %d\n", info.num_bcache_evictions);
+  printf(1, "num_dirty_writebacks = %d\n", info.num_dirty_writebacks);
+  printf(1, "num_disk_cmds = %d\n", info.num_disk_cmds);
+  printf(1, "num_disk_sectors = %d\n", info.num_disk_sectors);
+  printf(1, "io_wait_ticks = %d\n", info.io_wait_ticks);
+  printf(1, "num_icache_hits = %d\n", info.num_icache_hits);
+  printf(1, "num_icache_misses = %d\n", info.num_icache_misses);
+  printf(1, "num_dcache_hits = %d\n", info.num_dcache_hits);
+  printf(1, "num_dcache_misses = %d\n", info.num_dcache_misses);
 
   exit();
 }